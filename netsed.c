@@ -19,9 +19,12 @@
 ///@brief netsed is implemented in this single file.
 ///@par Architecture
 /// Netsed is implemented as a select socket dispatcher.
-/// First a main socket server is created (#lsock), each connection to this
-/// socket create a context stored in the tracker_s structure and added to
-/// the #connections list.
+/// First the server sockets are created (listener_s::lsock), one for each
+/// listener given on the command line or in the configuration file, each
+/// connection to these sockets create a context stored in the tracker_s
+/// structure and added to the #connections list. All listeners are served by
+/// the same dispatcher, listeners using the same rules share their compiled
+/// rule set (see rulesrc_s).
 /// Each connection has
 /// - a connected socket (tracker_s::csock) returned by the accept() function
 ///   for tcp, or
@@ -32,7 +35,8 @@
 /// as follows:
 /// - When packets are received from the client, the rules are applied by
 ///   sed_the_buffer() and the packet is send to the server.
-///   This is the role of client2server_sed() function. It is only used for tcp.
+///   This is the role of client2server_sed() function. It is only used for
+///   tcp, and udp in TPROXY mode.
 /// - When packets are received from the server, the rules are applied by
 ///   sed_the_buffer() and the packet is send to the corresponding client.
 ///   This is the role of server2client_sed() function.
@@ -44,7 +48,8 @@
 ///   This is the role of b2server_sed() function.
 /// .
 /// @note For tcp tracker_s::csa is NULL and for udp the tracker_s::csock is
-/// filled with #lsock. This is done in order to share code and avoid
+/// filled with listener_s::lsock (or, in TPROXY mode, with a socket bound to
+/// the original destination, selected like a tcp one). This is done in order to share code and avoid
 /// discriminating between tcp or udp everywhere, sendto are done on
 /// tracker_s::csock with tracker_s::csa only and the actual value of those
 /// will reflect the needs.
@@ -64,13 +69,17 @@
 /// The TODO file:
 ///@verbinclude TODO
 
+// for accept4()
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -81,6 +90,12 @@
 #include <signal.h>
 #include <netdb.h>
 #include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <limits.h>
 
 #if ANDROID
 #define in_port_t int
@@ -93,10 +108,16 @@
 #endif
 
 #ifdef LINUX_NETFILTER
-#include <limits.h>
 #include <linux/netfilter_ipv4.h>
 #endif
 
+/// Defined when the system supports TPROXY transparent proxy (-t option):
+/// listening sockets accept connections to any address and the original
+/// destination is their local address.
+#if defined(IP_TRANSPARENT) && defined(IPV6_TRANSPARENT)
+#define TPROXY
+#endif
+
 /// Current version (recovered by Makefile for several release checks)
 #define VERSION "1.00b"
 /// max size for buffers
@@ -118,20 +139,118 @@
 /// Timeout for udp 'connections' in seconds
 #define UDP_TIMEOUT 30
 
-/// Rule item.
+/// Seconds a server is skipped after a failed connection, without health
+/// probes (-H option).
+#define BACKEND_DOWN 10
+/// Points of each server on the consistent hashing ring.
+#define BACKEND_POINTS 64
+/// Milliseconds before connecting to the next address of a server while
+/// the previous attempts are still running (RFC 8305 "Happy Eyeballs").
+#define CONNECT_DELAY 250
+/// Most connections accepted from a listening socket before the other
+/// sockets are served.
+#define ACCEPT_BUDGET 64
+
+/// Seconds to wait for a DNS server reply.
+#define DNS_TIMEOUT 5
+/// Seconds before resolving again after a DNS failure.
+#define DNS_RETRY 30
+/// Longest TTL followed, in seconds.
+#define DNS_MAXTTL 86400
+
+/// Rule item: what sed_the_buffer() uses to rewrite a match, exactly one
+/// cache line (#RULE_ALIGN) per rule on 64 bit hosts, fields ordered so
+/// there is no padding. The matchers read copies of some fields, in
+/// rulehot_s. The text of the rule is apart, in rulestr_s.
 struct rule_s {
   /// binary buffer to match.
   char *from;
+  /// #RULE_MASKED rules: bits of each byte of #from to compare, stored
+  /// after it, NULL for literal rules.
+  char *mask;
   /// binary buffer replacement.
   char *to;
-  /// match from the command line.
-  const char *forig;
-  /// replacement from the command line.
-  const char *torig;
   /// length of #from buffer.
   int fs;
   /// length of #to buffer.
   int ts;
+  /// RULE_* flags.
+  unsigned int flags;
+  /// Index of the TTL counter of the rule in tracker_s::live, -1 for rules
+  /// that never expire for a connection.
+  int ttl;
+  /// #RULE_GLOBAL rules: remaining count of all connections, in
+  /// ruleset_s::left, NULL for the other rules.
+  int *left;
+  /// lowest stream offset where the match can start ('@' flag).
+  uint64_t smin;
+  /// highest stream offset where the match can start ('@' and 'w' flags),
+  /// UINT64_MAX if not limited.
+  uint64_t smax;
+};
+
+/// Rule text, only used for logging and to identify the rule across reloads.
+struct rulestr_s {
+  /// match from the command line.
+  const char *forig;
+  /// replacement from the command line.
+  const char *torig;
+  /// whole rule as written, owns the #forig and #torig storage and identifies
+  /// the rule across reloads.
+  char *text;
+};
+
+/// Alignment of the compiled rules, a cache line, and size of rule_s.
+#define RULE_ALIGN 64
+
+/// Fields of the rules read by the matchers, one array by field, each
+/// aligned on a cache line (#RULE_ALIGN): scanning a field of many rules
+/// loads only that field. Built by ruleset_compile() from the rule_s array,
+/// which sed_the_buffer() still uses to rewrite a match.
+struct rulehot_s {
+  /// By rule: rule_s::from.
+  const char **from;
+  /// By rule: rule_s::fs.
+  int32_t *fs;
+  /// By rule: rule_s::ttl.
+  int32_t *ttl;
+  /// By rule: rule_s::left.
+  int **left;
+  /// By rule: rule_s::smin.
+  uint64_t *smin;
+  /// By rule: rule_s::smax.
+  uint64_t *smax;
+};
+
+#if UINTPTR_MAX > 0xffffffff
+_Static_assert(sizeof(struct rule_s) == RULE_ALIGN, "rule_s must fill one cache line");
+#endif
+
+/// Rule flag: the rule applies to data from client to server.
+#define RULE_C2S 1
+/// Rule flag: the rule applies to data from server to client.
+#define RULE_S2C 2
+/// Rule flag: the pattern has wildcards, see rule_s::mask.
+#define RULE_MASKED 4
+/// Rule flag: ASCII letters of the pattern match either case ('i' flag).
+#define RULE_NOCASE 8
+/// Rule flag: the expire count is shared by all connections ('g' flag),
+/// see rule_s::left.
+#define RULE_GLOBAL 16
+/// Longest pattern of a #RULE_MASKED or #RULE_NOCASE rule.
+#define MASKED_MAX 64
+
+/// Tell if rule @a r is a literal rule of direction @a dir, the others are
+/// matched by the automaton of find_masked().
+#define LITERAL_RULE(r, dir) \
+  (((r)->flags & (RULE_MASKED | RULE_NOCASE | (1 << (dir)))) == (1 << (dir)))
+
+/// Direction of the data, also index of ruleset_s::trie.
+enum dir_e {
+  /// from client to server (1 << C2S is #RULE_C2S).
+  C2S,
+  /// from server to client (1 << S2C is #RULE_S2C).
+  S2C
 };
 
 /// Connection state
@@ -162,8 +281,20 @@ struct tracker_s {
   time_t time;
   /// Connection state
   enum state_e state;
-  /// By connection TTL
+  /// Rule set #live belongs to.
+  struct ruleset_s *rs;
+  /// By connection TTL counters, indexed by rule_s::ttl: ruleset_s::ttl,
+  /// shared, until the connection uses a rule with a TTL.
   int* live;
+  /// Stream offset of the next data received, by direction (tcp only).
+  uint64_t pos[2];
+  /// End of data received, by direction (tcp only): the other side was
+  /// shut down for writing, the reverse direction keeps forwarding.
+  int eof[2];
+  /// Listener the connection was received on.
+  struct listener_s *ls;
+  /// Server the connection is forwarded to, NULL for dynamic forwarding.
+  struct backend_s *be;
 
   /// chain it !
   struct tracker_s * n;
@@ -171,51 +302,554 @@ struct tracker_s {
 
 /// Store current time (just after select returned).
 time_t now;
-/// Listening socket.
-int lsock;
-/// Number of rules.
-int rules;
-/// Array of all rules.
-struct rule_s *rule;
-/// TTL part of the rule as a flat array to be able to copy it
-/// in tracker_s::live for each connections.
-int *rule_live;
+/// Most rules of a direction matched by #K_PACKED.
+#define PACKED_RULES 4
+/// Most rules of a direction matched by #K_FEW: from 8 rules the block
+/// hash is faster (netsed bench).
+#define FEW_RULES 4
+/// Number of block hashes of #K_HASH, a power of 2.
+#define HASH_TABLE 65536
+/// Hash of the @a b (2 or 3) bytes at @a p for #K_HASH.
+#define HASH_BLOCK(p, b) ((b) == 2 ? ((p)[0] | ((p)[1] << 8)) \
+                                   : (((p)[0] | ((p)[1] << 8)) ^ ((p)[2] << 5)) & (HASH_TABLE-1))
+
+/// Matching algorithm of a direction, chosen by plan_kernel() when the
+/// rule set is compiled, from the number and length of the patterns.
+enum kernel_e {
+  /// no rule: nothing to look for.
+  K_NONE,
+  /// a single rule: memchr() for one byte, else memmem() (two-way).
+  K_ONE,
+  /// up to #PACKED_RULES patterns of 8 bytes or less: a first byte filter
+  /// then a masked 64 bit compare by pattern.
+  K_PACKED,
+  /// up to #FEW_RULES rules of 2 bytes or more: memmem() for each one,
+  /// the next occurrences are remembered while scanning a buffer.
+  K_FEW,
+  /// many rules of 2 bytes or more: Wu-Manber block hash, the window of the
+  /// shortest pattern length skips ahead by the shift of its last block,
+  /// candidates are verified against the patterns with that block.
+  K_HASH,
+  /// general case: the trie walked from each offset, see match_rule().
+  K_TRIE
+};
+
+/// Rule applied when several match at the same offset.
+enum match_e {
+  /// not set by the rule file: the -m option.
+  MATCH_DEFAULT,
+  /// the first in rule set order (leftmost-first).
+  MATCH_FIRST,
+  /// the longest pattern, the first of those (leftmost-longest).
+  MATCH_LONGEST
+};
+
+/// 64 bit word of the Shift-And automaton of #RULE_MASKED and #RULE_NOCASE
+/// rules: the patterns of several rules laid out one after the other, one
+/// bit a byte. Wildcards and case folding are in the byte tables, so they
+/// cost nothing while matching.
+struct maskword_s {
+  /// By byte value: bits of the pattern bytes it matches.
+  uint64_t b[256];
+  /// First bit of each pattern.
+  uint64_t start;
+  /// Last bit of each pattern.
+  uint64_t end;
+  /// By last bit: the rule of the pattern.
+  int32_t rule[64];
+  /// Longest pattern of the word.
+  int mlen;
+};
+
+/// Matcher compiled from the patterns of a rule set.
+/// This is a trie of all rule_s::from walked from each offset of the buffer
+/// by match_rule(). Nodes and edges are flat arrays of indexes, so that the
+/// whole structure can be stored in a compiled rule file (see ruledb_s) and
+/// used directly from the mapped file.
+struct trie_s {
+  /// Number of nodes, node 0 is the root.
+  uint32_t nodes;
+  /// Number of edges.
+  uint32_t edges;
+  /// Child of the root for each first byte, 0 if no pattern starts with it.
+  uint32_t *root;
+  /// By node: lowest rule index whose pattern ends there, -1 if none.
+  int32_t *term;
+  /// By node: lowest rule index in the subtree, to stop the walk early.
+  int32_t *min;
+  /// By node: index of its first edge, edges of a node are sorted by byte.
+  uint32_t *child;
+  /// By node: number of edges.
+  uint32_t *nchild;
+  /// By edge: byte to match.
+  uint8_t *ebyte;
+  /// By edge: node reached.
+  uint32_t *enode;
+  /// By rule: next rule with the same pattern (higher index), -1 if none.
+  int32_t *next;
+  /// Memory of the arrays, NULL when they are in ruleset_s::map.
+  void *mem;
+  /// Stream offset after which no rule of the trie can match anymore,
+  /// UINT64_MAX if some rule is not limited to a window.
+  uint64_t horizon;
+  /// Longest pattern of the direction.
+  int longest;
+  /// Number of rules of the direction with a finite TTL, per connection
+  /// or global.
+  int finite;
+  /// Matching algorithm of the direction.
+  enum kernel_e kernel;
+  /// Rule applied when several match at the same offset, #MATCH_FIRST or
+  /// #MATCH_LONGEST.
+  enum match_e match;
+  /// #K_ONE, #K_PACKED and #K_FEW: number of rules of the direction.
+  int nk;
+  /// #K_ONE, #K_PACKED and #K_FEW: rules of the direction, by index.
+  int krule[FEW_RULES];
+  /// #K_PACKED: patterns loaded as 64 bit words, see find_literal().
+  uint64_t kpat[PACKED_RULES];
+  /// #K_PACKED: masks of the pattern bytes in #kpat.
+  uint64_t kmask[PACKED_RULES];
+  /// #K_PACKED: 1 for the first bytes of the patterns.
+  uint8_t kfirst[256];
+  /// #K_HASH: length of the window, the shortest pattern length.
+  int wlen;
+  /// #K_HASH: length of the hashed blocks, 2 or 3 bytes.
+  int wblock;
+  /// #K_HASH: by block hash, how far the window can move when it ends with
+  /// that block, 0 if some pattern window ends with it.
+  uint8_t *wshift;
+  /// #K_HASH: by block hash, first candidate in #wrule, #HASH_TABLE+1
+  /// entries.
+  uint32_t *wstart;
+  /// #K_HASH: candidate rules, grouped by hash of the last block of their
+  /// window, by increasing index in each group.
+  int32_t *wrule;
+  /// #K_HASH: first 2 bytes of the candidate patterns in #wrule.
+  uint16_t *wprefix;
+  /// Memory of the #K_HASH arrays, NULL if not built.
+  void *wmem;
+  /// Number of words of the automaton of the #RULE_MASKED and #RULE_NOCASE
+  /// rules, which are matched apart from the literal rules.
+  int nmw;
+  /// Words of the automaton of the #RULE_MASKED and #RULE_NOCASE rules.
+  struct maskword_s *mw;
+};
+
+/// Compiled set of rules.
+/// A rule set is never modified once built: reload_rules() builds a new one
+/// and swaps the rulesrc_s::rs pointer, connections keep a reference on the set
+/// their tracker_s::live counters belong to until they move to the new one
+/// (see rebind_ruleset()).
+struct ruleset_s {
+  /// Number of rules.
+  int rules;
+  /// Array of all rules, aligned on a cache line once compiled.
+  struct rule_s *rule;
+  /// Text of each rule.
+  struct rulestr_s *str;
+  /// By rule: TTL part of the rule, -1 for infinite.
+  int *rule_live;
+  /// Initial value of the #nttl counters of the rules with a TTL, by
+  /// rule_s::ttl. Connections share it as tracker_s::live until they
+  /// change one, so they cost nothing while they have only infinite rules.
+  int *ttl;
+  /// Number of rules with a TTL for each connection.
+  int nttl;
+  /// By rule: remaining count of #RULE_GLOBAL rules, shared by all the
+  /// connections, only changed by sed_the_buffer() in the main thread,
+  /// with atomic operations; their #rule_live is -1.
+  int *left;
+  /// Identity hash table: rule index + 1 by hash of rule_s::text, 0 if free.
+  int *ident;
+  /// Size of #ident, a power of 2.
+  unsigned int identsz;
+  /// Allocated size of #rule and #rule_live.
+  int cap;
+  /// Number of rules owning their buffers, the others are in #map.
+  int owned;
+  /// Buffers of the owned rules once compiled, see ruleset_pack(), or NULL.
+  char *arena;
+  /// Matcher arrays once compiled, in one allocation starting at
+  /// rulehot_s::from.
+  struct rulehot_s hot;
+  /// Rule applied when several match at the same offset, set by a 'match'
+  /// line of the rule file.
+  enum match_e match;
+  /// Pattern matcher of each direction, holding only the rules of that
+  /// direction.
+  struct trie_s trie[2];
+  /// Compiled rule file mapped in memory, or NULL.
+  void *map;
+  /// Size of #map.
+  size_t mapsz;
+  /// Number of references: its rulesrc_s and connections.
+  int refs;
+};
+
+/// Magic string of compiled rule files.
+#define RULEDB_MAGIC "NSEDRDB\n"
+/// Version of the compiled rule file format.
+#define RULEDB_VERSION 6
+
+/// Trie of a compiled rule file, see trie_s.
+struct ruledb_trie_s {
+  /// trie_s::nodes.
+  uint32_t nodes;
+  /// trie_s::edges.
+  uint32_t edges;
+  /// trie_s::next array.
+  uint64_t next_off;
+  /// trie_s::term array.
+  uint64_t term_off;
+  /// trie_s::min array.
+  uint64_t min_off;
+  /// trie_s::child array.
+  uint64_t child_off;
+  /// trie_s::nchild array.
+  uint64_t nchild_off;
+  /// trie_s::enode array.
+  uint64_t enode_off;
+  /// trie_s::root array.
+  uint64_t root_off;
+  /// trie_s::ebyte array.
+  uint64_t ebyte_off;
+};
+
+/// Header of a compiled rule file, written by "netsed compile".
+/// All offsets are from the start of the file, so the file can be mapped
+/// anywhere, read-only and shared by all processes using it.
+/// The sections follow the header in the order of the offsets, each one
+/// aligned on 8 bytes, strings are last.
+struct ruledb_s {
+  /// #RULEDB_MAGIC.
+  char magic[8];
+  /// 0x01020304 in the byte order of the compiling host.
+  uint32_t order;
+  /// #RULEDB_VERSION.
+  uint32_t version;
+  /// Number of rules.
+  uint32_t rules;
+  /// ruleset_s::match.
+  uint32_t match;
+  /// Total size of the file.
+  uint64_t size;
+  /// ruledb_rule_s array.
+  uint64_t rule_off;
+  /// Strings: patterns and rule texts.
+  uint64_t str_off;
+  /// Tries, by direction.
+  struct ruledb_trie_s trie[2];
+};
+
+/// Rule of a compiled rule file, strings are given by offset.
+struct ruledb_rule_s {
+  /// rule_s::from.
+  uint64_t from;
+  /// rule_s::to.
+  uint64_t to;
+  /// rulestr_s::text.
+  uint64_t text;
+  /// rulestr_s::forig.
+  uint64_t forig;
+  /// rulestr_s::torig.
+  uint64_t torig;
+  /// rule_s::fs.
+  int32_t fs;
+  /// rule_s::ts.
+  int32_t ts;
+  /// TTL of the rule.
+  int32_t live;
+  /// length of the rulestr_s::text storage.
+  int32_t textsz;
+  /// rule_s::flags.
+  uint32_t flags;
+  /// padding.
+  uint32_t pad;
+  /// rule_s::smin.
+  uint64_t smin;
+  /// rule_s::smax.
+  uint64_t smax;
+};
+
+/// Where the rules of a listener come from: command line rules and/or a
+/// rule file. Listeners using the same rules share the same source, and so
+/// the same compiled rule set.
+struct rulesrc_s {
+  /// Rules given on the command line.
+  char **args;
+  /// Number of #args.
+  int nargs;
+  /// Rule file, NULL if none.
+  const char *file;
+  /// Current rule set, used for new connections.
+  struct ruleset_s *rs;
+
+  /// chain it !
+  struct rulesrc_s * n;
+};
+
+/// State of a pooled upstream connection.
+enum pooled_e {
+  /// free slot, to refill.
+  EMPTY,
+  /// non-blocking connect() in progress.
+  CONNECTING,
+  /// connected and idle.
+  READY,
+  /// connected, and the server already sent data (e.g. a banner).
+  GREETED
+};
+
+/// Pre-connected upstream connection (-p option).
+struct pooled_s {
+  /// Socket, when not #EMPTY.
+  int fd;
+  /// Connection state.
+  enum pooled_e state;
+};
+
+/// Load balancing method between the servers of a listener (-b option).
+enum balance_e {
+  /// each server in turn.
+  ROUNDROBIN,
+  /// server with the fewest connections.
+  LEASTCONN,
+  /// consistent hashing of the client address.
+  SOURCEHASH
+};
+
+/// Server a listener forwards to, one of the comma separated rhost.
+struct backend_s {
+  /// Host as given by the user.
+  char *host;
+  /// Resolved addresses, with the port.
+  struct sockaddr_storage *addr;
+  /// Sizes of #addr.
+  socklen_t *addrl;
+  /// Number of #addr.
+  int naddr;
+  /// Connections forwarded to this server.
+  int conns;
+  /// Time the server was found down, 0 if up.
+  time_t down;
+  /// Health probe socket, -1 if no probe is running.
+  int probe;
+  /// Time of the next DNS resolution, or end of the running one, 0 if the
+  /// server is not resolved again (-D option).
+  time_t refresh;
+  /// Socket of the running DNS queries, -1 if none.
+  int dns;
+  /// Id of the A query, the AAAA query has the next one.
+  uint16_t qid;
+  /// Queries answered: 1 for A, 2 for AAAA.
+  int replied;
+  /// Addresses received by the running queries.
+  struct sockaddr_storage *raddr;
+  /// Sizes of #raddr.
+  socklen_t *raddrl;
+  /// Number of #raddr.
+  int nraddr;
+  /// Smallest TTL of #raddr.
+  uint32_t rttl;
+};
+
+/// Point of a consistent hashing ring.
+struct ringpoint_s {
+  /// Position on the ring.
+  uint32_t h;
+  /// Index of the server in listener_s::backends.
+  int be;
+};
+
+/// Listening socket and where its connections are forwarded.
+struct listener_s {
+  /// Listening socket.
+  int lsock;
+  /// 1 tcp, 0 udp.
+  int tcp;
+  /// Listener as given by the user: proto, lport, rhost, rport.
+  char *spec[4];
+  /// Servers to forward to, none for dynamic forwarding.
+  struct backend_s *backends;
+  /// Number of #backends.
+  int nbackends;
+  /// Next server for round robin, also rotates least connections ties.
+  unsigned int rr;
+  /// Consistent hashing ring, #BACKEND_POINTS per server, sorted.
+  struct ringpoint_s *ring;
+  /// Time of the next round of health probes.
+  time_t next_probe;
+  /// Forwarding port, 0 for dynamic forwarding.
+  in_port_t fixedport;
+  /// Rules of the connections.
+  struct rulesrc_s *src;
+  /// Pre-connected upstream connections, #poolsz of them, NULL if none.
+  struct pooled_s *pool;
+  /// Do not refill the pool before this time, after a connect() failure.
+  time_t pool_retry;
+
+  /// chain it !
+  struct listener_s * n;
+};
+
+/// List of rule sources.
+struct rulesrc_s * rulesrcs = NULL;
+
+/// List of listeners, in configuration order.
+struct listener_s * listeners = NULL;
+
+/// True for TPROXY transparent proxy (-t option).
+int tproxy = 0;
+/// True to connect to the server from the client address (-s option).
+int keepsrc = 0;
+/// Number of pre-connected upstream connections per listener (-p option).
+int poolsz = 0;
+/// Length of the queue of connections waiting for accept() (-l option).
+int backlog = SOMAXCONN;
+/// Seconds a tcp connection waits for its first data before being
+/// accepted, 0 to accept it once established (-A option).
+int deferaccept = 0;
+/// Queue length of TCP Fast Open connections, 0 to disable (-F option).
+int fastopen = 0;
+/// Seconds without data before a tcp connection is closed, 0 for never
+/// (-i option).
+int idletimeout = 0;
+/// TCP keepalive idle time, interval and probe count, none if the idle
+/// time is 0 (-k option).
+int keepalive[3] = { 0, 0, 0 };
+/// TCP_USER_TIMEOUT in milliseconds, 0 for the system default (-u option).
+int usertimeout = 0;
+/// Threads scanning large buffers along with the main one, 0 for none
+/// (-j option).
+int scanthreads = 0;
+/// Smallest buffer scanned by several threads (-j option).
+int scanmin = 32768;
+/// Rule applied when several match at the same offset, for the rule sets
+/// whose rule file does not tell (-m option).
+enum match_e matchmode = MATCH_FIRST;
+/// DNS server resolving the server names again when their TTL expires
+/// (-D option), not used if its size is 0.
+struct sockaddr_storage dnsserver;
+/// Size of #dnsserver.
+socklen_t dnsserverl = 0;
+/// Load balancing method (-b option).
+enum balance_e balance = ROUNDROBIN;
+/// Names of the load balancing methods.
+const char *balance_name[] = { "rr", "lc", "hash" };
+/// Interval of the health probes in seconds, 0 for none (-H option).
+int probeint = 0;
 
 /// List of connections.
 struct tracker_s * connections = NULL;
 
 /// True when SIGINT signal was received.
 volatile int stop=0;
+/// True when SIGHUP signal was received and rules should be reloaded.
+volatile int reload=0;
+/// True when SIGUSR1 signal was received and statistics should be printed.
+volatile int dump=0;
+
+/// Counters printed on SIGUSR1 and at exit, see print_stats().
+struct stats_s {
+  /// Connections accepted, and udp pseudo-connections.
+  unsigned long conns;
+  /// tcp connections closed after the -i idle timeout.
+  unsigned long reaped;
+  /// udp pseudo-connections expired after #UDP_TIMEOUT.
+  unsigned long expired;
+  /// Packets forwarded without change.
+  unsigned long untouched;
+  /// Packets changed only by length preserving rules, patched in place.
+  unsigned long inplace;
+  /// Packets changed by a rule changing their length, copied to b2.
+  unsigned long copied;
+  /// Packets scanned in chunks by several threads.
+  unsigned long parallel;
+} stats;
 
 /// Display an error message followed by usage information.
 /// @param why the error message.
 void usage_hints(const char* why) {
   ERR("Error: %s\n\n",why);
-  ERR("Usage: netsed proto lport rhost rport rule1 [ rule2 ... ]\n\n");
+  ERR("Usage: netsed [ -f rulefile ] proto lport rhost rport [ rule1 ... ]\n");
+  ERR("       netsed -c config [ -f rulefile ] [ proto lport rhost rport [ rule1 ... ] ]\n");
+  ERR("       netsed compile rulefile -o compiledfile\n");
+  ERR("       netsed bench [ seconds ]\n\n");
+  ERR("  -t      - TPROXY transparent proxy, the original destination is the\n");
+  ERR("            local address of the connection (see README)\n");
+  ERR("  -s      - connect to the server from the client address and port,\n");
+  ERR("            needs -t or CAP_NET_ADMIN\n");
+  ERR("  -p num  - keep num pre-connected server connections for each tcp\n");
+  ERR("            listener with fixed forwarding, for faster connections\n");
+  ERR("  -b alg  - balancing between comma separated rhost servers: rr (round\n");
+  ERR("            robin, default), lc (least connections), hash (client address)\n");
+  ERR("  -H secs - probe the tcp servers every secs seconds\n");
+  ERR("  -l num  - queue up to num tcp connections waiting to be accepted\n");
+  ERR("  -A secs - accept tcp connections once the client sent data, or\n");
+  ERR("            after secs seconds (TCP_DEFER_ACCEPT)\n");
+  ERR("  -F num  - accept num TCP Fast Open connections with data in the SYN\n");
+  ERR("  -i secs - close tcp connections without data for secs seconds\n");
+  ERR("  -k idle[,intvl[,cnt]] - tcp keepalive probes after idle seconds,\n");
+  ERR("            every intvl seconds, cnt times\n");
+  ERR("  -u msec - TCP_USER_TIMEOUT, drop connections with data unacknowledged\n");
+  ERR("            for msec milliseconds\n");
+  ERR("  -j num[,bytes] - scan buffers of bytes or more (default 32768) in\n");
+  ERR("            num+1 chunks, num of them by worker threads\n");
+  ERR("  -m mode - rule applied when several match at the same offset: first\n");
+  ERR("            (default, in rule order) or longest (longest pattern), rule\n");
+  ERR("            files can set it for their rules with a 'match mode' line\n");
+  ERR("  -D dns  - resolve the rhost names again with DNS server dns (ip or\n");
+  ERR("            ip,port; 0 for the first /etc/resolv.conf one) when their\n");
+  ERR("            TTL expires\n");
+  ERR("  -c file - read more listeners from file, one per line as\n");
+  ERR("            'proto lport rhost rport [ rulefile ]', without rule file\n");
+  ERR("            the listener uses the command line rules and -f file\n");
+  ERR("  -f file - read additional rules from file, one per line, reloaded on\n");
+  ERR("            SIGHUP without dropping connections, the file can also be\n");
+  ERR("            compiled first with 'netsed compile' for large rule sets\n");
   ERR("  proto   - protocol specification (tcp or udp)\n");
   ERR("  lport   - local port to listen on (see README for transparent\n");
-  ERR("            traffic intercepting on some systems)\n");
+  ERR("            traffic intercepting on some systems), or unix:path for a\n");
+  ERR("            unix socket (unix:@name for an abstract one)\n");
   ERR("  rhost   - where connection should be forwarded (0 = use destination\n");
-  ERR("            address of incoming connection, see README)\n");
+  ERR("            address of incoming connection, see README), or unix:path\n");
+  ERR("            (rport is then ignored)\n");
   ERR("  rport   - destination port (0 = dst port of incoming connection)\n");
-  ERR("  ruleN   - replacement rules (see below)\n\n");
-  ERR("General syntax of replacement rules: s/pat1/pat2[/expire]\n\n");
+  ERR("  ruleN   - replacement rules (see below), at least one is needed\n");
+  ERR("            without rule file\n\n");
+  ERR("General syntax of replacement rules: s/pat1/pat2[/[expire][flags]]\n\n");
   ERR("This will replace all occurrences of pat1 with pat2 in any matching packet.\n");
   ERR("An additional parameter (count) can be used to expire a rule after 'count'\n");
   ERR("successful substitutions for a given connection. Eight-bit characters,\n");
   ERR("including NULL and '/', can be passed using HTTP-like hex escape\n");
   ERR("sequences (e.g. CRLF as %%0a%%0d).\n");
-  ERR("A match on '%%' can be achieved by specifying '%%%%'. Examples:\n\n");
+  ERR("A match on '%%' can be achieved by specifying '%%%%'.\n");
+  ERR("In pat1, '?' in place of a hex digit matches any value of that nibble\n");
+  ERR("(e.g. %%?? matches any byte, %%?3 any byte ending with 3).\n");
+  ERR("Flags can follow the expire count (which can be omitted):\n");
+  ERR("  c - only apply to data from client to server\n");
+  ERR("  s - only apply to data from server to client\n");
+  ERR("  i - ASCII case insensitive match of pat1 (pat2 is sent as is)\n");
+  ERR("  g - the expire count is shared by all connections\n");
+  ERR("  wN - only match within the first N bytes sent in this direction\n");
+  ERR("       (of each datagram for udp)\n");
+  ERR("  @K - only match at offset K of the data sent in this direction\n");
+  ERR("Examples:\n\n");
   ERR("  's/andrew/mike/1'     - replace 'andrew' with 'mike' (only first time)\n");
   ERR("  's/andrew/mike'       - replace all occurrences of 'andrew' with 'mike'\n");
   ERR("  's/andrew/mike%%00%%00' - replace 'andrew' with 'mike\\x00\\x00'\n");
   ERR("                          (manually padding to keep original size)\n");
-  ERR("  's/%%%%/%%2f/20'         - replace the 20 first occurrence of '%%' with '/'\n\n");
+  ERR("  's/%%%%/%%2f/20'         - replace the 20 first occurrence of '%%' with '/'\n");
+  ERR("  's/andrew/mike/c'     - replace 'andrew' with 'mike', only from client\n");
+  ERR("  's/HTTP/XTTP/c@0'     - replace 'HTTP' at the very start of the request\n\n");
   ERR("Rules are not active across packet boundaries, and they are evaluated\n");
   ERR("from first to last, not yet expired rule, as stated on the command line.\n");
   exit(1);
 }
 
+void ruleset_release(struct ruleset_s *rs);
+
 /// Helper function to free a tracker_s item.
 /// csa will be freed if needed, sockets will be closed
 /// @param conn pointer to free.
@@ -223,10 +857,19 @@ void freetracker (struct tracker_s * conn)
 {
   if(conn->csa != NULL) { // udp
     free(conn->csa);
-  } else { // tcp
+  }
+  // tcp, or udp replying from its own socket
+  if(conn->csock != conn->ls->lsock) {
     close(conn->csock);
   }
-  close(conn->fsock);
+  if(conn->fsock >= 0) {
+    close(conn->fsock);
+  }
+  if(conn->be != NULL) {
+    conn->be->conns--;
+  }
+  if (conn->rs && (conn->live != conn->rs->ttl)) free(conn->live);
+  ruleset_release(conn->rs);
   free(conn);
 }
 
@@ -234,7 +877,22 @@ void freetracker (struct tracker_s * conn)
 /// to use before exit.
 void clean_socks(void)
 {
-  close(lsock);
+  int i;
+  struct listener_s *ls;
+  for (ls = listeners; ls != NULL; ls = ls->n) {
+    for (i = 0; ls->pool && (i < poolsz); i++)
+      if (ls->pool[i].state != EMPTY) close(ls->pool[i].fd);
+    for (i = 0; i < ls->nbackends; i++) {
+      if (ls->backends[i].probe >= 0) close(ls->backends[i].probe);
+      if (ls->backends[i].dns >= 0) close(ls->backends[i].dns);
+    }
+    if (ls->lsock >= 0) {
+      close(ls->lsock);
+      // remove our unix socket, unless abstract
+      if (!strncmp(ls->spec[1], "unix:", 5) && (ls->spec[1][5] != '@'))
+        unlink(ls->spec[1]+5);
+    }
+  }
   // close all tracker
   while(connections != NULL) {
     struct tracker_s * conn = connections;
@@ -293,6 +951,74 @@ int is_addr_any(struct sockaddr *sa) {
 } /* is_addr_any(struct sockaddr *) */
 
 
+/// Fill a unix socket address from a "unix:path" specification, or
+/// "unix:@name" for the Linux abstract namespace.
+/// @param spec lport or rhost as given by the user.
+/// @param ss   address to fill.
+/// @param l    set to the size of the address.
+/// @return 1 if @a spec is a unix socket, else 0.
+int unix_addr(const char *spec, struct sockaddr_storage *ss, socklen_t *l) {
+  struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+  size_t len;
+
+  if (strncmp(spec, "unix:", 5)) return 0;
+  spec += 5;
+  len = strlen(spec);
+  if (!len || (len >= sizeof(sun->sun_path))) usage_hints("invalid unix socket path");
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  memcpy(sun->sun_path, spec, len);
+  if (*spec == '@') {
+    // abstract: no terminating NUL, the name is the whole length
+    sun->sun_path[0] = 0;
+    *l = offsetof(struct sockaddr_un, sun_path) + len;
+  } else {
+    *l = offsetof(struct sockaddr_un, sun_path) + len + 1;
+  }
+  return 1;
+} /* unix_addr(const char *, struct sockaddr_storage *, socklen_t *) */
+
+/// Printable form of a socket address, "host,port" or "unix:path".
+/// @param sa address.
+/// @param l  size of @a sa.
+/// @return a static buffer, overwritten by the next call.
+const char *addr_str(struct sockaddr *sa, socklen_t l) {
+  static char str[INET6_ADDRSTRLEN+sizeof(((struct sockaddr_un *)0)->sun_path)+8];
+  char ipstr[INET6_ADDRSTRLEN], portstr[12];
+
+  if (sa->sa_family == AF_UNIX) {
+    struct sockaddr_un *sun = (struct sockaddr_un *)sa;
+    int n = l - offsetof(struct sockaddr_un, sun_path);
+    if (n <= 0) return "unix:(unnamed)";
+    if (sun->sun_path[0])
+      snprintf(str, sizeof(str), "unix:%.*s", n, sun->sun_path);
+    else
+      snprintf(str, sizeof(str), "unix:@%.*s", n-1, sun->sun_path+1);
+    return str;
+  }
+  if (getnameinfo(sa, l, ipstr, sizeof(ipstr), portstr, sizeof(portstr),
+                  NI_NUMERICHOST | NI_NUMERICSERV))
+    return "?";
+  snprintf(str, sizeof(str), "%s,%s", ipstr, portstr);
+  return str;
+} /* addr_str(struct sockaddr *, socklen_t) */
+
+/// Allow a socket to use an address that is not local, for TPROXY.
+/// @param sd socket.
+/// @param af address family of the socket.
+/// @return 0, or -1 with errno set.
+int set_transparent(int sd, int af) {
+#ifdef TPROXY
+  int one = 1;
+  if (af == AF_INET6)
+    return setsockopt(sd, SOL_IPV6, IPV6_TRANSPARENT, &one, sizeof(one));
+  return setsockopt(sd, SOL_IP, IP_TRANSPARENT, &one, sizeof(one));
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+} /* set_transparent(int, int) */
+
 /// Display an error message and exit.
 void error(const char* reason) {
   ERR("[-] Error: %s\n",reason);
@@ -304,72 +1030,1023 @@ void error(const char* reason) {
 /// Hex digit to parsing the % notation in rules
 char hex[]="0123456789ABCDEF";
 
-/// Convert the % notation in rules to plain binary data
-/// @param r rule to update
-void shrink_to_binary(struct rule_s* r) {
+/// Convert the % notation of a rule pattern to plain binary data.
+/// @param orig  pattern as written in the rule.
+/// @param bin   output buffer, at least strlen(orig) long.
+/// @param mask  NULL if wildcards are not allowed, else output buffer of
+///              the bits to compare of each byte of @a bin, 0xff if all.
+/// @param len   set to the length of the binary data.
+/// @param what  "src" or "dst", for error messages.
+/// @return NULL or an error message.
+const char* unescape_pattern(const char *orig, char *bin, char *mask, int *len,
+                             const char *what) {
+  static char msg[80];
   unsigned int i;
 
-  r->from=malloc(strlen(r->forig));
-  r->to=malloc(strlen(r->torig));
-  if ((!r->from) || (!r->to)) error("shrink_to_binary: unable to malloc() buffers");
-
-  for (i=0;i<strlen(r->forig);i++) {
-    if (r->forig[i]=='%') {
+  *len=0;
+  for (i=0;orig[i];i++) {
+    if (orig[i]=='%') {
       // Have to shrink.
       i++;
-      if (r->forig[i]=='%') {
+      if (orig[i]=='%') {
         // '%%' -> '%'
-        r->from[r->fs]='%';
-        r->fs++;
+        if (mask) mask[*len]=0xff;
+        bin[(*len)++]='%';
       } else {
         int hexval;
         char* x;
-        if (!r->forig[i]) error("shrink_to_binary: src pattern: unexpected end.");
-        if (!r->forig[i+1]) error("shrink_to_binary: src pattern: unexpected end.");
-        x=strchr(hex,toupper(r->forig[i]));
-        if (!x) error("shrink_to_binary: src pattern: non-hex sequence.");
-        hexval=(x-hex)*16;
-        x=strchr(hex,toupper(r->forig[i+1]));
-        if (!x) error("shrink_to_binary: src pattern: non-hex sequence.");
-        hexval+=(x-hex);
-        r->from[r->fs]=hexval;
-        r->fs++; i++;
+        snprintf(msg, sizeof(msg), "shrink_to_binary: %s pattern: unexpected end.", what);
+        if (!orig[i]) return msg;
+        if (!orig[i+1]) return msg;
+        snprintf(msg, sizeof(msg), "shrink_to_binary: %s pattern: non-hex sequence.", what);
+        if (mask) mask[*len]=0xff;
+        if (mask && (orig[i]=='?')) {
+          mask[*len]&=0x0f;
+          hexval=0;
+        } else {
+          x=strchr(hex,toupper(orig[i]));
+          if (!x) return msg;
+          hexval=(x-hex)*16;
+        }
+        if (mask && (orig[i+1]=='?')) {
+          mask[*len]&=0xf0;
+        } else {
+          x=strchr(hex,toupper(orig[i+1]));
+          if (!x) return msg;
+          hexval+=(x-hex);
+        }
+        bin[(*len)++]=hexval;
+        i++;
       }
     } else {
       // Plaintext case.
-      r->from[r->fs]=r->forig[i];
-      r->fs++;
+      if (mask) mask[*len]=0xff;
+      bin[(*len)++]=orig[i];
     }
   }
+  return NULL;
+}
 
-  for (i=0;i<strlen(r->torig);i++) {
-    if (r->torig[i]=='%') {
-      // Have to shrink.
-      i++;
-      if (r->torig[i]=='%') {
-        // '%%' -> '%'
-        r->to[r->ts]='%';
-        r->ts++;
-      } else {
-        int hexval;
-        char* x;
-        if (!r->torig[i]) error("shrink_to_binary: dst pattern: unexpected end.");
-        if (!r->torig[i+1]) error("shrink_to_binary: dst pattern: unexpected end.");
-        x=strchr(hex,toupper(r->torig[i]));
-        if (!x) error("shrink_to_binary: dst pattern: non-hex sequence.");
-        hexval=(x-hex)*16;
-        x=strchr(hex,toupper(r->torig[i+1]));
-        if (!x) error("shrink_to_binary: dst pattern: non-hex sequence.");
-        hexval+=(x-hex);
-        r->to[r->ts]=hexval;
-        r->ts++; i++;
+/// Convert the % notation in rules to plain binary data, a pattern with
+/// wildcards gets a mask and the #RULE_MASKED flag.
+/// @param r rule to update
+/// @param s text of the rule.
+/// @return NULL or an error message.
+const char* shrink_to_binary(struct rule_s* r, const struct rulestr_s *s) {
+  const char *err;
+  char *mask;
+  int i;
+
+  // the mask of wildcards is stored after the pattern
+  r->from=malloc(2*strlen(s->forig)+1);
+  r->to=malloc(strlen(s->torig)+1);
+  r->mask=NULL;
+  if ((!r->from) || (!r->to)) return "shrink_to_binary: unable to malloc() buffers";
+
+  mask=r->from+strlen(s->forig);
+  if ((err=unescape_pattern(s->forig, r->from, mask, &r->fs, "src"))) return err;
+  if (!r->fs) return "shrink_to_binary: src pattern: empty.";
+  for (i=0;(i<r->fs) && ((uint8_t)mask[i] == 0xff);i++);
+  if (i<r->fs) {
+    r->mask=r->from+r->fs;
+    memmove(r->mask, mask, r->fs);
+    r->flags |= RULE_MASKED;
+  }
+  if ((r->flags & (RULE_MASKED|RULE_NOCASE)) && (r->fs > MASKED_MAX))
+    return "shrink_to_binary: src pattern: longer than 64 bytes with wildcards or 'i' flag.";
+  return unescape_pattern(s->torig, r->to, NULL, &r->ts, "dst");
+}
+
+/// Parse a rule written as s/pat1/pat2[/[expire][flags]].
+/// @param r    rule to fill.
+/// @param s    text of the rule to fill, it gets its own copy of @a src.
+/// @param live set to the TTL of the rule (-1 for infinite).
+/// @param src  the rule text.
+/// @return NULL or an error message.
+const char* parse_rule(struct rule_s* r, struct rulestr_s *s, int *live, const char *src) {
+  const char *err;
+  char *fs=0, *ts=0, *cs=0;
+  size_t len=strlen(src);
+  uint64_t win=UINT64_MAX;
+
+  // keep text intact for identity, and split a copy stored after it
+  s->text=malloc(2*len+2);
+  if (!s->text) return "unable to malloc() rule";
+  strcpy(s->text, src);
+  strcpy(s->text+len+1, src);
+  fs=strchr(s->text+len+1,'/');
+  if (!fs) return "missing first '/' in rule";
+  fs++;
+  ts=strchr(fs,'/');
+  if (!ts) return "missing second '/' in rule";
+  *ts=0;
+  ts++;
+  cs=strchr(ts,'/');
+  if (cs) { *cs=0; cs++; }
+  s->forig=fs;
+  s->torig=ts;
+  if (cs && (isdigit(*cs) || (*cs == '-'))) /* Only non-trivial quantifiers count. */
+    *live=strtol(cs, &cs, 10); else *live=-1;
+  // flags after the quantifier
+  r->flags=0;
+  r->smin=0;
+  r->smax=UINT64_MAX;
+  for (;cs && *cs;cs++) {
+    char *end;
+    unsigned long long v;
+    switch (*cs) {
+      case 'c': r->flags |= RULE_C2S; break;
+      case 's': r->flags |= RULE_S2C; break;
+      case 'i': r->flags |= RULE_NOCASE; break;
+      case 'g': r->flags |= RULE_GLOBAL; break;
+      case 'w':
+      case '@':
+        if (!isdigit(cs[1])) return "missing offset after 'w' or '@' in rule";
+        v=strtoull(cs+1, &end, 10);
+        if (*cs=='@') {
+          if (v > r->smin) r->smin=v;
+          if (v < r->smax) r->smax=v;
+        } else if (v < win) win=v;
+        cs=end-1;
+        break;
+      default: return "unknown flag in rule";
+    }
+  }
+  // no direction given: both
+  if (!(r->flags & (RULE_C2S|RULE_S2C))) r->flags |= RULE_C2S|RULE_S2C;
+  if ((r->flags & RULE_GLOBAL) && (*live < 0)) return "'g' flag without expire count in rule";
+  if ((err=shrink_to_binary(r, s))) return err;
+  if (win != UINT64_MAX) {
+    // the window bounds the end of the match
+    if (win < (uint64_t)r->fs) return "pattern larger than window in rule";
+    if (win-r->fs < r->smax) r->smax=win-r->fs;
+  }
+  if (r->smin > r->smax) return "offset out of window in rule";
+  return NULL;
+}
+
+/// Hash rule_s::text for the rule set identity table.
+unsigned int rule_hash(const char *text) {
+  unsigned int h = 2166136261u;
+  while (*text) h = (h ^ (unsigned char)*text++) * 16777619u;
+  return h;
+}
+
+/// FNV-1a hash of a buffer.
+/// @param p buffer.
+/// @param n size of @a p.
+/// @param h initial value, 2166136261 or the hash of the previous data.
+uint32_t fnv1a(const void *p, size_t n, uint32_t h) {
+  const unsigned char *c = p;
+  while (n--) h = (h ^ *c++) * 16777619u;
+  return h;
+}
+
+/// Free a rule set.
+void ruleset_free(struct ruleset_s *rs) {
+  int i;
+  for (i=0;(i<rs->owned) && !rs->arena;i++) {
+    free(rs->rule[i].from);
+    free(rs->rule[i].to);
+    free(rs->str[i].text);
+  }
+  free(rs->arena);
+  free(rs->hot.from);
+  free(rs->rule);
+  free(rs->str);
+  free(rs->rule_live);
+  free(rs->left);
+  free(rs->ttl);
+  free(rs->ident);
+  free(rs->trie[C2S].mem);
+  free(rs->trie[S2C].mem);
+  free(rs->trie[C2S].wmem);
+  free(rs->trie[S2C].wmem);
+  free(rs->trie[C2S].mw);
+  free(rs->trie[S2C].mw);
+  if (rs->map) munmap(rs->map, rs->mapsz);
+  free(rs);
+}
+
+/// Drop a reference on a rule set, freeing it with the last one.
+void ruleset_release(struct ruleset_s *rs) {
+  if (rs && (--rs->refs == 0)) ruleset_free(rs);
+}
+
+/// Make room for @a n rules in a rule set being built.
+/// @return 0 on allocation failure.
+int ruleset_reserve(struct ruleset_s *rs, int n) {
+  struct rule_s *r;
+  struct rulestr_s *s;
+  int *l;
+  if (n <= rs->cap) return 1;
+  // grow by power of 2
+  if (n < 2*rs->cap) n = 2*rs->cap;
+  r = realloc(rs->rule, n*sizeof(struct rule_s));
+  if (r) rs->rule = r;
+  s = realloc(rs->str, n*sizeof(struct rulestr_s));
+  if (s) rs->str = s;
+  l = realloc(rs->rule_live, n*sizeof(int));
+  if (l) rs->rule_live = l;
+  if (!r || !s || !l) return 0;
+  rs->cap = n;
+  return 1;
+}
+
+/// Append a rule to a rule set being built.
+/// @param rs  rule set to update.
+/// @param src rule text.
+/// @return NULL or an error message.
+const char* ruleset_add(struct ruleset_s *rs, const char *src) {
+  if (!ruleset_reserve(rs, rs->rules+1)) return "unable to malloc() rule arrays";
+  memset(&rs->rule[rs->rules], '\0', sizeof(struct rule_s));
+  memset(&rs->str[rs->rules], '\0', sizeof(struct rulestr_s));
+  rs->rules++;
+  rs->owned++;
+  return parse_rule(&rs->rule[rs->rules-1], &rs->str[rs->rules-1],
+                    &rs->rule_live[rs->rules-1], src);
+}
+
+/// Find a rule of a rule set by its text.
+/// @return the rule index or -1.
+int ruleset_find(struct ruleset_s *rs, const char *text) {
+  unsigned int h;
+  if (!rs->identsz) return -1;
+  for (h=rule_hash(text);;h++) {
+    int k = rs->ident[h & (rs->identsz-1)];
+    if (!k) return -1;
+    if (!strcmp(rs->str[k-1].text, text)) return k-1;
+  }
+}
+
+/// Rule set being compiled, for cmp_pattern().
+struct ruleset_s *sort_rs;
+
+/// Order rules by pattern, then by index, for qsort().
+int cmp_pattern(const void *a, const void *b) {
+  const struct rule_s *x = &sort_rs->rule[*(const int *)a];
+  const struct rule_s *y = &sort_rs->rule[*(const int *)b];
+  int c = memcmp(x->from, y->from, (x->fs < y->fs) ? x->fs : y->fs);
+  if (c) return c;
+  if (x->fs != y->fs) return x->fs - y->fs;
+  return *(const int *)a - *(const int *)b;
+}
+
+/// Build the trie node of the rules order[lo..hi-1], which are sorted by
+/// cmp_pattern() and share their first @a d bytes.
+/// @return the node index.
+uint32_t trie_build(struct trie_s *t, const struct rule_s *rule, const int *order,
+                    int lo, int hi, int d) {
+  uint32_t n = t->nodes++, e;
+  int32_t prev = -1;
+  int i, g;
+
+  t->term[n] = -1;
+  t->min[n] = INT32_MAX;
+  // patterns ending here sort first, chain them by index
+  while ((lo < hi) && (rule[order[lo]].fs == d)) {
+    int32_t r = order[lo++];
+    if (prev < 0) t->term[n] = r; else t->next[prev] = r;
+    t->next[r] = -1;
+    prev = r;
+    if (r < t->min[n]) t->min[n] = r;
+  }
+  // one edge by distinct byte at offset d
+  t->child[n] = t->edges;
+  t->nchild[n] = 0;
+  for (i=lo;i<hi;i=g) {
+    for (g=i+1;(g<hi) && (rule[order[g]].from[d] == rule[order[i]].from[d]);g++);
+    t->nchild[n]++;
+  }
+  e = t->edges;
+  t->edges += t->nchild[n];
+  for (i=lo;i<hi;i=g,e++) {
+    for (g=i+1;(g<hi) && (rule[order[g]].from[d] == rule[order[i]].from[d]);g++);
+    t->ebyte[e] = rule[order[i]].from[d];
+    t->enode[e] = trie_build(t, rule, order, i, g, d+1);
+    if (t->min[t->enode[e]] < t->min[n]) t->min[n] = t->min[t->enode[e]];
+  }
+  return n;
+}
+
+/// Compile the patterns of the rules of one direction into a trie.
+/// @param rs  rule set.
+/// @param dir direction of the trie.
+/// @return NULL or an error message.
+const char* trie_compile(struct ruleset_s *rs, enum dir_e dir) {
+  struct trie_s *t = &rs->trie[dir];
+  size_t nodes = 1, sz;
+  int *order;
+  uint32_t e;
+  int i, n = 0;
+
+  order = malloc(rs->rules*sizeof(int)+1);
+  if (!order) return "unable to malloc() rule matcher";
+  for (i=0;i<rs->rules;i++)
+    if (LITERAL_RULE(&rs->rule[i], dir)) {
+      order[n++] = i;
+      nodes += rs->rule[i].fs;
+    }
+  if (nodes > INT32_MAX) {
+    free(order);
+    return "rule patterns too large";
+  }
+  // one block for all arrays, by decreasing alignment
+  sz = 256*sizeof(uint32_t) + nodes*(5*sizeof(uint32_t) + sizeof(uint8_t))
+     + rs->rules*sizeof(int32_t);
+  t->mem = calloc(1, sz);
+  if (!t->mem) {
+    free(order);
+    return "unable to malloc() rule matcher";
+  }
+  t->root = t->mem;
+  t->term = (int32_t *)(t->root + 256);
+  t->min = t->term + nodes;
+  t->child = (uint32_t *)(t->min + nodes);
+  t->nchild = t->child + nodes;
+  t->enode = t->nchild + nodes;
+  t->next = (int32_t *)(t->enode + nodes);
+  t->ebyte = (uint8_t *)(t->next + rs->rules);
+
+  sort_rs = rs;
+  qsort(order, n, sizeof(int), cmp_pattern);
+  t->nodes = 0;
+  t->edges = 0;
+  trie_build(t, rs->rule, order, 0, n, 0);
+  free(order);
+
+  for (e=t->child[0];e<t->child[0]+t->nchild[0];e++)
+    t->root[t->ebyte[e]] = t->enode[e];
+  return NULL;
+}
+
+/// Build the Shift-And automaton of the #RULE_MASKED and #RULE_NOCASE rules
+/// of one direction.
+/// @param rs  rule set.
+/// @param dir direction.
+/// @return NULL or an error message.
+const char* mask_compile(struct ruleset_s *rs, enum dir_e dir) {
+  struct trie_s *t = &rs->trie[dir];
+  struct maskword_s *w = NULL;
+  int i, j, c, bit = 64;
+
+  t->nmw = 0;
+  for (i=0;i<rs->rules;i++) {
+    const struct rule_s *r = &rs->rule[i];
+    if (!(r->flags & (1 << dir)) || LITERAL_RULE(r, dir)) continue;
+    if (bit + r->fs > 64) {
+      // next word
+      w = realloc(t->mw, (t->nmw+1)*sizeof(struct maskword_s));
+      if (!w) return "unable to malloc() rule matcher";
+      t->mw = w;
+      w = &t->mw[t->nmw++];
+      memset(w, 0, sizeof(*w));
+      bit = 0;
+    }
+    w->start |= (uint64_t)1 << bit;
+    for (j=0;j<r->fs;j++) {
+      uint8_t m = r->mask ? r->mask[j] : 0xff;
+      for (c=0;c<256;c++)
+        if (((c & m) == (uint8_t)r->from[j])
+            || ((r->flags & RULE_NOCASE) && isalpha(c) && (((c ^ 0x20) & m) == (uint8_t)r->from[j])))
+          w->b[c] |= (uint64_t)1 << (bit+j);
+    }
+    bit += r->fs;
+    w->end |= (uint64_t)1 << (bit-1);
+    w->rule[bit-1] = i;
+    if (r->fs > w->mlen) w->mlen = r->fs;
+  }
+  return NULL;
+}
+
+/// Build the Wu-Manber tables of #K_HASH for the rules of one direction,
+/// all of 2 bytes or more.
+/// @param rs  rule set.
+/// @param dir direction.
+/// @param m   length of the shortest pattern of the direction.
+/// @return NULL or an error message.
+const char* hash_compile(struct ruleset_s *rs, enum dir_e dir, int m) {
+  struct trie_s *t = &rs->trie[dir];
+  uint32_t h, n = 0;
+  int i, q;
+
+  t->wlen = (m > 255) ? 255 : m;
+  t->wblock = (t->wlen < 4) ? 2 : 3;
+  for (i=0;i<rs->rules;i++)
+    if (LITERAL_RULE(&rs->rule[i], dir)) n++;
+  // one block for all arrays, by decreasing alignment
+  t->wmem = malloc((HASH_TABLE+1)*sizeof(uint32_t) + n*(sizeof(int32_t)+sizeof(uint16_t))
+                   + HASH_TABLE);
+  if (!t->wmem) return "unable to malloc() rule matcher";
+  t->wstart = t->wmem;
+  t->wrule = (int32_t *)(t->wstart + HASH_TABLE+1);
+  t->wprefix = (uint16_t *)(t->wrule + n);
+  t->wshift = (uint8_t *)(t->wprefix + n);
+  memset(t->wshift, t->wlen - t->wblock + 1, HASH_TABLE);
+  memset(t->wstart, 0, (HASH_TABLE+1)*sizeof(uint32_t));
+  for (i=0;i<rs->rules;i++) {
+    const uint8_t *f = (const uint8_t *)rs->rule[i].from;
+    if (!LITERAL_RULE(&rs->rule[i], dir)) continue;
+    for (q=0;q+t->wblock<=t->wlen;q++) {
+      h = HASH_BLOCK(f+q, t->wblock);
+      if (t->wshift[h] > t->wlen - t->wblock - q) t->wshift[h] = t->wlen - t->wblock - q;
+    }
+    // count the group sizes, shifted by one for the prefix sum
+    t->wstart[HASH_BLOCK(f + t->wlen - t->wblock, t->wblock) + 1]++;
+  }
+  for (h=1;h<=HASH_TABLE;h++) t->wstart[h] += t->wstart[h-1];
+  // fill in index order, wstart[h] moves to the end of group h...
+  for (i=0;i<rs->rules;i++) {
+    const uint8_t *f = (const uint8_t *)rs->rule[i].from;
+    if (!LITERAL_RULE(&rs->rule[i], dir)) continue;
+    h = HASH_BLOCK(f + t->wlen - t->wblock, t->wblock);
+    t->wrule[t->wstart[h]] = i;
+    t->wprefix[t->wstart[h]++] = f[0] | (f[1] << 8);
+  }
+  // ...which is the start of group h+1
+  memmove(t->wstart+1, t->wstart, HASH_TABLE*sizeof(uint32_t));
+  t->wstart[0] = 0;
+  return NULL;
+}
+
+/// Choose the matching algorithm of a direction, see kernel_e.
+/// The thresholds come from "netsed bench": one memmem() per rule wins up to
+/// 4 rules of 2 bytes or more, the block hash beyond, one byte patterns are
+/// left to the packed compares or the trie.
+/// @param rs  rule set.
+/// @param dir direction.
+/// @return NULL or an error message.
+const char* plan_kernel(struct ruleset_s *rs, enum dir_e dir) {
+  struct trie_s *t = &rs->trie[dir];
+  int i, n = 0, longest = 0, shortest = INT_MAX;
+
+  memset(t->kfirst, 0, sizeof(t->kfirst));
+  for (i=0;i<rs->rules;i++) {
+    struct rule_s *r = &rs->rule[i];
+    if (!LITERAL_RULE(r, dir)) continue;
+    if (r->fs > longest) longest = r->fs;
+    if (r->fs < shortest) shortest = r->fs;
+    if (n < FEW_RULES) t->krule[n] = i;
+    if (n < PACKED_RULES) {
+      t->kpat[n] = t->kmask[n] = 0;
+      if (r->fs <= 8) {
+        memcpy(&t->kpat[n], r->from, r->fs);
+        memset(&t->kmask[n], 0xff, r->fs);
+      }
+      t->kfirst[(uint8_t)r->from[0]] = 1;
+    }
+    n++;
+  }
+  t->nk = (n < FEW_RULES) ? n : FEW_RULES;
+  if (!n) t->kernel = K_NONE;
+  else if (n == 1) t->kernel = K_ONE;
+  else if ((n <= FEW_RULES) && (shortest >= 2)) t->kernel = K_FEW;
+  else if (shortest >= 2) t->kernel = K_HASH;
+  else if ((n <= PACKED_RULES) && (longest <= 8)) t->kernel = K_PACKED;
+  else t->kernel = K_TRIE;
+  if (t->kernel == K_HASH) return hash_compile(rs, dir, shortest);
+  return NULL;
+}
+
+/// Move the buffers of the owned rules to one allocation, ruleset_s::arena:
+/// first all the patterns, masks and replacements, contiguous for the
+/// matchers, then the cold rule texts. The rule array is moved to memory
+/// aligned on a cache line.
+/// @return NULL or an error message.
+const char* ruleset_pack(struct ruleset_s *rs) {
+  size_t hot = 0, cold = 0;
+  char *a, *h, *c;
+  void *p;
+  int i;
+
+  for (i=0;i<rs->owned;i++) {
+    hot += (rs->rule[i].mask ? 2 : 1)*rs->rule[i].fs + rs->rule[i].ts;
+    // text and its split copy
+    cold += 2*strlen(rs->str[i].text) + 2;
+  }
+  if (posix_memalign(&p, RULE_ALIGN, hot+cold+1)) return "unable to malloc() rule arena";
+  a = h = p;
+  c = a + hot;
+  for (i=0;i<rs->owned;i++) {
+    struct rule_s *rl = &rs->rule[i];
+    struct rulestr_s *rt = &rs->str[i];
+    size_t fl = (rl->mask ? 2 : 1)*rl->fs, tl = 2*strlen(rt->text) + 2;
+    memcpy(h, rl->from, fl);
+    free(rl->from);
+    rl->from = h;
+    if (rl->mask) rl->mask = h + rl->fs;
+    h += fl;
+    memcpy(h, rl->to, rl->ts);
+    free(rl->to);
+    rl->to = h;
+    h += rl->ts;
+    memcpy(c, rt->text, tl);
+    rt->forig = c + (rt->forig - rt->text);
+    rt->torig = c + (rt->torig - rt->text);
+    free(rt->text);
+    rt->text = c;
+    c += tl;
+  }
+  rs->arena = a;
+  if (posix_memalign(&p, RULE_ALIGN, rs->rules*sizeof(struct rule_s)+1)) return "unable to malloc() rule arrays";
+  memcpy(p, rs->rule, rs->rules*sizeof(struct rule_s));
+  free(rs->rule);
+  rs->rule = p;
+  rs->cap = rs->rules;
+  return NULL;
+}
+
+/// Round @a n up to a multiple of #RULE_ALIGN.
+#define RULE_ROUND(n) (((n) + RULE_ALIGN - 1) & ~(size_t)(RULE_ALIGN - 1))
+
+/// Build ruleset_s::hot from the rule array, once its TTL indexes and
+/// global counts are set.
+/// @return NULL or an error message.
+const char* ruleset_hot(struct ruleset_s *rs) {
+  struct rulehot_s *h = &rs->hot;
+  size_t n = rs->rules ? rs->rules : 1;
+  size_t pz = RULE_ROUND(n*sizeof(void *)), iz = RULE_ROUND(n*sizeof(int32_t)),
+         uz = RULE_ROUND(n*sizeof(uint64_t));
+  char *a;
+  void *p;
+  int i;
+
+  if (posix_memalign(&p, RULE_ALIGN, 2*pz + 2*iz + 2*uz)) return "unable to malloc() rule arrays";
+  a = p;
+  h->from = (const char **)a;
+  h->left = (int **)(a + pz);
+  h->smin = (uint64_t *)(a + 2*pz);
+  h->smax = (uint64_t *)(a + 2*pz + uz);
+  h->fs = (int32_t *)(a + 2*pz + 2*uz);
+  h->ttl = (int32_t *)(a + 2*pz + 2*uz + iz);
+  for (i=0;i<rs->rules;i++) {
+    h->from[i] = rs->rule[i].from;
+    h->left[i] = rs->rule[i].left;
+    h->smin[i] = rs->rule[i].smin;
+    h->smax[i] = rs->rule[i].smax;
+    h->fs[i] = rs->rule[i].fs;
+    h->ttl[i] = rs->rule[i].ttl;
+  }
+  return NULL;
+}
+
+/// Compile the rule patterns of a rule set into its tries.
+/// @return NULL or an error message.
+const char* ruleset_compile(struct ruleset_s *rs) {
+  const char *err;
+  int i, d;
+  if ((err = ruleset_pack(rs))) return err;
+  // global counts move out of the per connection TTL
+  rs->left = malloc(rs->rules*sizeof(int)+1);
+  rs->ttl = malloc(rs->rules*sizeof(int)+1);
+  if (!rs->left || !rs->ttl) return "unable to malloc() rule arrays";
+  rs->nttl = 0;
+  for (i=0;i<rs->rules;i++) {
+    rs->rule[i].left = NULL;
+    rs->rule[i].ttl = -1;
+    if (rs->rule[i].flags & RULE_GLOBAL) {
+      rs->left[i] = rs->rule_live[i];
+      rs->rule_live[i] = -1;
+      rs->rule[i].left = &rs->left[i];
+    } else if (rs->rule_live[i] >= 0) {
+      // dense index of the per connection counters
+      rs->rule[i].ttl = rs->nttl;
+      rs->ttl[rs->nttl++] = rs->rule_live[i];
+    }
+  }
+  if ((err = ruleset_hot(rs))) return err;
+  if (!rs->trie[C2S].nodes && (err = trie_compile(rs, C2S))) return err;
+  if (!rs->trie[S2C].nodes && (err = trie_compile(rs, S2C))) return err;
+  // stream offset from where a direction has nothing left to match
+  for (d=C2S;d<=S2C;d++) {
+    uint64_t h = 0;
+    for (i=0;(i<rs->rules) && (h<UINT64_MAX);i++)
+      if ((rs->rule[i].flags & (1 << d)) && (rs->rule[i].smax >= h))
+        h = (rs->rule[i].smax == UINT64_MAX) ? UINT64_MAX : rs->rule[i].smax+1;
+    rs->trie[d].horizon = h;
+    rs->trie[d].match = (rs->match == MATCH_DEFAULT) ? matchmode : rs->match;
+    rs->trie[d].longest = 0;
+    rs->trie[d].finite = 0;
+    for (i=0;i<rs->rules;i++)
+      if (rs->rule[i].flags & (1 << d)) {
+        if (rs->rule[i].fs > rs->trie[d].longest) rs->trie[d].longest = rs->rule[i].fs;
+        if ((rs->rule_live[i] > 0) || rs->rule[i].left) rs->trie[d].finite++;
       }
+    if ((err = plan_kernel(rs, d))) return err;
+    if ((err = mask_compile(rs, d))) return err;
+  }
+  return NULL;
+}
+
+/// Find the edge of trie node @a n for byte @a c.
+/// @return the node reached, or 0 if none.
+uint32_t trie_child(const struct trie_s *t, uint32_t n, uint8_t c) {
+  uint32_t lo = t->child[n], hi = lo + t->nchild[n];
+  // binary search in sorted edges, linear at the end
+  while (hi - lo > 8) {
+    uint32_t mid = (lo + hi) / 2;
+    if (t->ebyte[mid] <= c) lo = mid; else hi = mid;
+  }
+  for (;lo<hi;lo++)
+    if (t->ebyte[lo] == c) return t->enode[lo];
+  return 0;
+}
+
+/// Tell if @a n elements of @a elem bytes at offset @a off fit in a
+/// compiled rule file of @a size bytes, without any overflow.
+#define RULEDB_FITS(off, n, elem, size) \
+  (((off) <= (size)) && ((uint64_t)(n) <= ((size) - (off)) / (elem)))
+
+/// Check that a trie of a compiled rule file is consistent.
+/// @return NULL or an error message.
+const char* ruledb_check_trie(const struct ruledb_s *db, const struct ruledb_trie_s *dt,
+                              size_t size) {
+  const char *base = (const char *)db;
+  const uint32_t *child, *nchild, *enode, *root;
+  const int32_t *term, *min, *next;
+  uint64_t i;
+
+  if ((dt->nodes < 1) || (dt->edges >= dt->nodes) || (dt->nodes > INT32_MAX)
+      || !RULEDB_FITS(dt->next_off, db->rules, sizeof(int32_t), size)
+      || !RULEDB_FITS(dt->term_off, dt->nodes, sizeof(int32_t), size)
+      || !RULEDB_FITS(dt->min_off, dt->nodes, sizeof(int32_t), size)
+      || !RULEDB_FITS(dt->child_off, dt->nodes, sizeof(uint32_t), size)
+      || !RULEDB_FITS(dt->nchild_off, dt->nodes, sizeof(uint32_t), size)
+      || !RULEDB_FITS(dt->enode_off, dt->edges, sizeof(uint32_t), size)
+      || !RULEDB_FITS(dt->root_off, 256, sizeof(uint32_t), size)
+      || !RULEDB_FITS(dt->ebyte_off, dt->edges, 1, size))
+    return "truncated compiled rule file";
+  next = (const void *)(base + dt->next_off);
+  term = (const void *)(base + dt->term_off);
+  min = (const void *)(base + dt->min_off);
+  child = (const void *)(base + dt->child_off);
+  nchild = (const void *)(base + dt->nchild_off);
+  enode = (const void *)(base + dt->enode_off);
+  root = (const void *)(base + dt->root_off);
+  for (i=0;i<db->rules;i++)
+    if ((next[i] < -1) || (next[i] >= (int64_t)db->rules))
+      return "corrupted compiled rule file";
+  for (i=0;i<dt->nodes;i++)
+    if ((term[i] < -1) || (term[i] >= (int64_t)db->rules) || (min[i] < 0)
+        || ((uint64_t)child[i] + nchild[i] > dt->edges))
+      return "corrupted compiled rule file";
+  for (i=0;i<dt->edges;i++)
+    if (enode[i] >= dt->nodes) return "corrupted compiled rule file";
+  for (i=0;i<256;i++)
+    if (root[i] >= dt->nodes) return "corrupted compiled rule file";
+  return NULL;
+}
+
+/// Check that a compiled rule file is consistent before using it.
+/// @return NULL or an error message.
+const char* ruledb_check(const struct ruledb_s *db, size_t size) {
+  const struct ruledb_rule_s *r;
+  const char *err;
+  uint64_t i;
+
+  if (size < sizeof(*db) || memcmp(db->magic, RULEDB_MAGIC, 8))
+    return "not a compiled rule file";
+  if (db->order != 0x01020304) return "compiled rule file from another architecture";
+  if (db->version != RULEDB_VERSION) return "unsupported compiled rule file version";
+  if (db->match > MATCH_LONGEST) return "corrupted compiled rule file";
+  if ((db->size != size) || (db->rules > INT32_MAX)
+      || !RULEDB_FITS(db->rule_off, db->rules, sizeof(*r), size)
+      || (db->str_off > size)
+      || (((const char *)db)[size-1] != 0))
+    return "truncated compiled rule file";
+  // strings are last and the file ends with a nul, so each one is terminated
+  r = (const void *)((const char *)db + db->rule_off);
+  for (i=0;i<db->rules;i++)
+    if ((r[i].fs < 1) || (r[i].ts < 0) || (r[i].textsz < 2)
+        || (r[i].from < db->str_off)
+        || !RULEDB_FITS(r[i].from, ((r[i].flags & RULE_MASKED) ? 2 : 1)*(uint64_t)r[i].fs, 1, size)
+        || ((r[i].flags & (RULE_MASKED|RULE_NOCASE)) && (r[i].fs > MASKED_MAX))
+        || (r[i].to < db->str_off) || !RULEDB_FITS(r[i].to, r[i].ts, 1, size)
+        || (r[i].text < db->str_off) || !RULEDB_FITS(r[i].text, r[i].textsz, 1, size)
+        || (r[i].forig < r[i].text) || (r[i].forig >= r[i].text + r[i].textsz)
+        || (r[i].torig < r[i].text) || (r[i].torig >= r[i].text + r[i].textsz))
+      return "corrupted compiled rule file";
+  if ((err = ruledb_check_trie(db, &db->trie[C2S], size))) return err;
+  return ruledb_check_trie(db, &db->trie[S2C], size);
+}
+
+/// Map a compiled rule file and append its rules to a rule set.
+/// When the rule set has no other rule, the compiled tries are used as is.
+/// @param rs   rule set being built.
+/// @param fd   opened compiled rule file.
+/// @param path name of the file, for messages.
+/// @return NULL or an error message.
+const char* ruleset_map(struct ruleset_s *rs, int fd, const char *path) {
+  const struct ruledb_s *db;
+  const struct ruledb_rule_s *r;
+  struct stat st;
+  const char *err;
+  char *base;
+  uint32_t i;
+  int d;
+
+  if (fstat(fd, &st)) return "cannot stat compiled rule file";
+  rs->mapsz = st.st_size;
+  rs->map = mmap(NULL, rs->mapsz, PROT_READ, MAP_SHARED, fd, 0);
+  if (rs->map == MAP_FAILED) {
+    rs->map = NULL;
+    return "cannot mmap() compiled rule file";
+  }
+  base = rs->map;
+  db = rs->map;
+  if ((err = ruledb_check(db, rs->mapsz))) return err;
+  if (!ruleset_reserve(rs, rs->rules + db->rules)) return "unable to malloc() rule arrays";
+  rs->match = db->match;
+  r = (const void *)(base + db->rule_off);
+  for (i=0;i<db->rules;i++) {
+    struct rule_s *d = &rs->rule[rs->rules];
+    d->from = base + r[i].from;
+    d->mask = (r[i].flags & RULE_MASKED) ? d->from + r[i].fs : NULL;
+    d->to = base + r[i].to;
+    rs->str[rs->rules].text = base + r[i].text;
+    rs->str[rs->rules].forig = base + r[i].forig;
+    rs->str[rs->rules].torig = base + r[i].torig;
+    d->fs = r[i].fs;
+    d->ts = r[i].ts;
+    d->flags = r[i].flags;
+    d->smin = r[i].smin;
+    d->smax = r[i].smax;
+    rs->rule_live[rs->rules++] = r[i].live;
+  }
+  if (rs->rules == (int)db->rules)
+    for (d=C2S;d<=S2C;d++) {
+      const struct ruledb_trie_s *dt = &db->trie[d];
+      struct trie_s *t = &rs->trie[d];
+      t->nodes = dt->nodes;
+      t->edges = dt->edges;
+      t->root = (void *)(base + dt->root_off);
+      t->term = (void *)(base + dt->term_off);
+      t->min = (void *)(base + dt->min_off);
+      t->child = (void *)(base + dt->child_off);
+      t->nchild = (void *)(base + dt->nchild_off);
+      t->ebyte = (void *)(base + dt->ebyte_off);
+      t->enode = (void *)(base + dt->enode_off);
+      t->next = (void *)(base + dt->next_off);
+    }
+  printf("[*] Mapped %u rule%s from compiled rule file %s.\n", db->rules,
+         (db->rules > 1) ? "s" : "", path);
+  return NULL;
+}
+
+/// Align compiled rule file sections on 8 bytes.
+#define RULEDB_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+/// Lay out a trie in a compiled rule file and copy it if the image is given.
+/// @param img  file image, or NULL to compute the layout only.
+/// @param dt   trie header to fill.
+/// @param t    trie to store.
+/// @param rules number of rules.
+/// @param off  offset of the trie sections.
+/// @return offset after the trie sections.
+uint64_t ruledb_put_trie(char *img, struct ruledb_trie_s *dt, const struct trie_s *t,
+                         int rules, uint64_t off) {
+  dt->nodes = t->nodes;
+  dt->edges = t->edges;
+  dt->next_off = off;
+  dt->term_off = dt->next_off + RULEDB_ALIGN(rules*sizeof(int32_t));
+  dt->min_off = dt->term_off + RULEDB_ALIGN(t->nodes*sizeof(int32_t));
+  dt->child_off = dt->min_off + RULEDB_ALIGN(t->nodes*sizeof(int32_t));
+  dt->nchild_off = dt->child_off + RULEDB_ALIGN(t->nodes*sizeof(uint32_t));
+  dt->enode_off = dt->nchild_off + RULEDB_ALIGN(t->nodes*sizeof(uint32_t));
+  dt->root_off = dt->enode_off + RULEDB_ALIGN(t->edges*sizeof(uint32_t));
+  dt->ebyte_off = dt->root_off + RULEDB_ALIGN(256*sizeof(uint32_t));
+  if (img) {
+    memcpy(img + dt->next_off, t->next, rules*sizeof(int32_t));
+    memcpy(img + dt->term_off, t->term, t->nodes*sizeof(int32_t));
+    memcpy(img + dt->min_off, t->min, t->nodes*sizeof(int32_t));
+    memcpy(img + dt->child_off, t->child, t->nodes*sizeof(uint32_t));
+    memcpy(img + dt->nchild_off, t->nchild, t->nodes*sizeof(uint32_t));
+    memcpy(img + dt->enode_off, t->enode, t->edges*sizeof(uint32_t));
+    memcpy(img + dt->root_off, t->root, 256*sizeof(uint32_t));
+    memcpy(img + dt->ebyte_off, t->ebyte, t->edges);
+  }
+  return dt->ebyte_off + RULEDB_ALIGN(t->edges);
+}
+
+/// Write a rule set to a compiled rule file.
+/// @param rs   compiled rule set.
+/// @param path file to write.
+/// @return NULL or an error message.
+const char* ruleset_write(struct ruleset_s *rs, const char *path) {
+  struct ruledb_s hdr, *db;
+  struct ruledb_rule_s *r;
+  uint64_t off, str;
+  char *img;
+  FILE *f;
+  int i, ok;
+
+  // layout: header, sections aligned on 8 bytes, then strings
+  off = RULEDB_ALIGN(sizeof(hdr)) + RULEDB_ALIGN(rs->rules*sizeof(*r));
+  off = ruledb_put_trie(NULL, &hdr.trie[C2S], &rs->trie[C2S], rs->rules, off);
+  str = ruledb_put_trie(NULL, &hdr.trie[S2C], &rs->trie[S2C], rs->rules, off);
+  off = str;
+  for (i=0;i<rs->rules;i++) {
+    const struct rule_s *rl = &rs->rule[i];
+    const struct rulestr_s *rt = &rs->str[i];
+    off += (rl->mask ? 2 : 1)*rl->fs + rl->ts + strlen(rt->text) + 1 + strlen(rt->forig) + 1
+         + strlen(rt->torig) + 1;
+  }
+  // final nul, see ruledb_check()
+  off++;
+  img = calloc(1, off);
+  if (!img) return "unable to malloc() compiled rule file";
+  db = (void *)img;
+  memcpy(db->magic, RULEDB_MAGIC, 8);
+  db->order = 0x01020304;
+  db->version = RULEDB_VERSION;
+  db->rules = rs->rules;
+  db->match = rs->match;
+  db->size = off;
+  db->rule_off = RULEDB_ALIGN(sizeof(*db));
+  db->str_off = str;
+  off = db->rule_off + RULEDB_ALIGN(rs->rules*sizeof(*r));
+  off = ruledb_put_trie(img, &db->trie[C2S], &rs->trie[C2S], rs->rules, off);
+  ruledb_put_trie(img, &db->trie[S2C], &rs->trie[S2C], rs->rules, off);
+  r = (void *)(img + db->rule_off);
+  off = str;
+  for (i=0;i<rs->rules;i++) {
+    const struct rule_s *rl = &rs->rule[i];
+    const struct rulestr_s *rt = &rs->str[i];
+    // text is stored alone, forig and torig after it as the split copy
+    size_t tl = strlen(rt->text) + 1;
+    r[i].fs = rl->fs;
+    r[i].ts = rl->ts;
+    r[i].live = rl->left ? rs->left[i] : rs->rule_live[i];
+    r[i].flags = rl->flags;
+    r[i].smin = rl->smin;
+    r[i].smax = rl->smax;
+    r[i].from = off;
+    memcpy(img + off, rl->from, rl->fs); off += rl->fs;
+    if (rl->mask) {
+      memcpy(img + off, rl->mask, rl->fs);
+      off += rl->fs;
+    }
+    r[i].to = off;
+    memcpy(img + off, rl->to, rl->ts); off += rl->ts;
+    r[i].text = off;
+    memcpy(img + off, rt->text, tl); off += tl;
+    r[i].forig = off;
+    strcpy(img + off, rt->forig); off += strlen(rt->forig) + 1;
+    r[i].torig = off;
+    strcpy(img + off, rt->torig); off += strlen(rt->torig) + 1;
+    r[i].textsz = off - r[i].text;
+  }
+
+  f = fopen(path, "wb");
+  if (!f) {
+    free(img);
+    return "cannot create compiled rule file";
+  }
+  ok = (fwrite(img, db->size, 1, f) == 1);
+  ok = !fclose(f) && ok;
+  free(img);
+  return ok ? NULL : "cannot write compiled rule file";
+}
+
+/// Build a rule set from command line rules and a rule file.
+/// @param rulefile rule file, NULL if none.
+/// @param argrules command line rules, applied before the file ones.
+/// @param nargrules number of @a argrules.
+/// @param err set to an error message on failure.
+/// @return the new rule set with one reference, or NULL on failure.
+struct ruleset_s *ruleset_load(const char *rulefile, char **argrules, int nargrules,
+                               const char **err) {
+  struct ruleset_s *rs = calloc(1, sizeof(struct ruleset_s));
+  int i;
+
+  *err = "unable to malloc() rule set";
+  if (!rs) return NULL;
+  rs->refs = 1;
+  for (i=0;i<nargrules;i++) {
+    printf("[*] Parsing rule %s...\n",argrules[i]);
+    if ((*err=ruleset_add(rs, argrules[i]))) goto fail;
+  }
+  if (rulefile) {
+    char *line = NULL;
+    size_t n = 0;
+    char magic[8];
+    FILE *f = fopen(rulefile, "r");
+    if (!f) {
+      static char msg[80];
+      snprintf(msg, sizeof(msg), "cannot open rule file: %s", strerror(errno));
+      *err = msg;
+      goto fail;
+    }
+    // compiled rule file ?
+    if ((fread(magic, 8, 1, f) == 1) && !memcmp(magic, RULEDB_MAGIC, 8)) {
+      *err = ruleset_map(rs, fileno(f), rulefile);
+      fclose(f);
+      if (*err) goto fail;
+      f = NULL;
     } else {
-      // Plaintext case.
-      r->to[r->ts]=r->torig[i];
-      r->ts++;
+      rewind(f);
+    }
+    while (f && (getline(&line, &n, f) > 0)) {
+      char *b = line, *e = line + strlen(line);
+      // trim spaces, skip empty lines and comments
+      while (isspace(*b)) b++;
+      while ((e > b) && isspace(e[-1])) *--e = 0;
+      if (!*b || (*b == '#')) continue;
+      if (!strncmp(b, "match", 5) && isspace(b[5])) {
+        // match semantics of the rule set
+        for (b+=5;isspace(*b);b++);
+        if (!strcmp(b, "first")) rs->match = MATCH_FIRST;
+        else if (!strcmp(b, "longest")) rs->match = MATCH_LONGEST;
+        else { *err = "unknown match mode in rule file"; break; }
+        continue;
+      }
+      printf("[*] Parsing rule %s...\n",b);
+      if ((*err=ruleset_add(rs, b))) break;
     }
+    free(line);
+    if (f) fclose(f);
+    if (*err) goto fail;
   }
+  if ((*err = ruleset_compile(rs))) goto fail;
+  // identity table, half full at most
+  for (rs->identsz=2; rs->identsz < 2*(unsigned int)rs->rules; rs->identsz*=2);
+  rs->ident = calloc(rs->identsz, sizeof(int));
+  *err = "unable to malloc() rule set";
+  if (!rs->ident) goto fail;
+  for (i=0;i<rs->rules;i++) {
+    unsigned int h=rule_hash(rs->str[i].text);
+    // keep the first of duplicated rules
+    if (ruleset_find(rs, rs->str[i].text) >= 0) continue;
+    while (rs->ident[h & (rs->identsz-1)]) h++;
+    rs->ident[h & (rs->identsz-1)] = i+1;
+  }
+  *err = NULL;
+  return rs;
+fail:
+  ruleset_free(rs);
+  return NULL;
+}
+
+/// Reload rules after SIGHUP.
+/// The new rule set is built aside, on failure the current one is kept.
+/// Connections are moved to the new set by rebind_ruleset() on their next
+/// packet, so the reload itself only costs the parsing of the new rules.
+/// The global counts of the #RULE_GLOBAL rules found in both sets are kept.
+void reload_rules(void) {
+  struct rulesrc_s *src;
+  int i;
+  for (src = rulesrcs; src != NULL; src = src->n) {
+    const char *err;
+    struct ruleset_s *rs = ruleset_load(src->file, src->args, src->nargs, &err);
+    if (!rs) {
+      printf("[!] Reload failed: %s, keeping previous rules.\n", err);
+      continue;
+    }
+    // global counts go on with the same rules
+    for (i=0;i<rs->rules;i++)
+      if (rs->rule[i].left) {
+        int k = ruleset_find(src->rs, rs->str[i].text);
+        if (k >= 0) rs->left[i] = src->rs->left[k];
+      }
+    ruleset_release(src->rs);
+    src->rs = rs;
+    printf("[+] Reloaded %d rule%s.\n", rs->rules, (rs->rules > 1) ? "s" : "");
+  }
+}
+
+/// Move a connection to the current rule set of its listener, if not
+/// already there.
+/// TTL counters of the rules found in both sets (same rule_s::text) are
+/// kept, other rules start with their initial TTL. A connection that did
+/// not change any counter keeps sharing ruleset_s::ttl.
+/// @param conn connection to update, tracker_s::rs is NULL for a new one.
+void rebind_ruleset(struct tracker_s *conn) {
+  struct ruleset_s *rs = conn->rs;
+  struct ruleset_s *ruleset = conn->ls->src->rs;
+  int j;
+  int *live;
+
+  if (rs == ruleset) return;
+  if (!rs || (conn->live == rs->ttl)) {
+    // same rules have the same initial TTL
+    live = ruleset->ttl;
+  } else {
+    live = malloc(ruleset->nttl*sizeof(int)+1);
+    if(NULL == live) error("netsed: unable to malloc() connection TTL");
+    for (j=0;j<ruleset->rules;j++) {
+      int k;
+      if (ruleset->rule[j].ttl < 0) continue;
+      // same rule in previous set: keep its counter
+      k = ruleset_find(rs, ruleset->str[j].text);
+      live[ruleset->rule[j].ttl] = ((k >= 0) && (rs->rule[k].ttl >= 0))
+        ? conn->live[rs->rule[k].ttl] : ruleset->ttl[ruleset->rule[j].ttl];
+    }
+    free(conn->live);
+  }
+  conn->live = live;
+  conn->rs = ruleset;
+  ruleset->refs++;
+  ruleset_release(rs);
 }
 
 /// Bind forward socket to given port.
@@ -403,21 +2080,49 @@ void bind_forward(int fsock, int af, int tcp, const char *portstr) {
   }
 }
 
+/// Start listening on a tcp listening socket, with the -l, -A and -F
+/// options. The socket becomes non-blocking, so that accept_connection()
+/// can accept until the queue is empty.
+/// @param lsock bound socket.
+/// @param inet  true for an ip socket, false for unix.
+/// @return 0, or -1 if listen() failed.
+int listen_tcp(int lsock, int inet) {
+  if (listen(lsock, backlog) < 0) return -1;
+  fcntl(lsock, F_SETFL, O_NONBLOCK);
+  if (!inet) return 0;
+#ifdef TCP_DEFER_ACCEPT
+  if (deferaccept && setsockopt(lsock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferaccept, sizeof(int)))
+    printf("    Failed to set TCP_DEFER_ACCEPT: %s.\n", strerror(errno));
+#endif
+#ifdef TCP_FASTOPEN
+  if (fastopen && setsockopt(lsock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(int)))
+    printf("    Failed to set TCP_FASTOPEN: %s.\n", strerror(errno));
+#endif
+  return 0;
+}
+
 /// Bind and optionally listen to a socket for netsed server port.
 /// @param af      address family.
 /// @param tcp     1 tcp, 0 udp.
 /// @param portstr string representing the port to bind
 ///                (will be resolved using getaddrinfo()).
-void bind_and_listen(int af, int tcp, const char *portstr) {
-  int ret;
+/// @return the listening socket.
+int bind_and_listen(int af, int tcp, const char *portstr) {
+  int ret, lsock = -1;
   struct addrinfo hints, *res, *reslist;
 
   memset(&hints, '\0', sizeof(hints));
-  hints.ai_family = af;
+  // a transparent proxy gets both IPv4 and IPv6 on a dual stack socket
+  hints.ai_family = (tproxy && !af) ? AF_INET6 : af;
   hints.ai_flags = AI_PASSIVE;
   hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
 
+retry:
   if ((ret = getaddrinfo(NULL, portstr, &hints, &reslist))) {
+    if (hints.ai_family != af) {
+      hints.ai_family = af;
+      goto retry;
+    }
     ERR("getaddrinfo(): %s\n", gai_strerror(ret));
     error("Impossible to resolve listening port.");
   }
@@ -428,7 +2133,11 @@ void bind_and_listen(int af, int tcp, const char *portstr) {
     if ( (lsock = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
       continue;
     setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-    //fcntl(lsock,F_SETFL,O_NONBLOCK);
+    if (tproxy && set_transparent(lsock, res->ai_family)) {
+      ERR("setsockopt(IP_TRANSPARENT): %s\n", strerror(errno));
+      close(lsock);
+      continue;
+    }
     /* Make our best to decide on dual-stacked listener. */
     one = (af == 0) ? 0 /* AF_UNSPEC given */ : 1; /* Preconditioned addr */
 //openwrt has not defined this
@@ -443,78 +2152,991 @@ void bind_and_listen(int af, int tcp, const char *portstr) {
       continue;
     }
     if (tcp) {
-      if (listen(lsock, 16) < 0) {
+      if (listen_tcp(lsock, 1) < 0) {
         close(lsock);
         continue;
       }
     } else { // udp
       int one=1;
       setsockopt(lsock,SOL_SOCKET,SO_OOBINLINE,&one,sizeof(int));
+#ifdef TPROXY
+      // original destination of the datagrams, see recv_datagram()
+      if (tproxy) {
+        setsockopt(lsock, SOL_IP, IP_RECVORIGDSTADDR, &one, sizeof(one));
+        if (res->ai_family == AF_INET6)
+          setsockopt(lsock, SOL_IPV6, IPV6_RECVORIGDSTADDR, &one, sizeof(one));
+      }
+#endif
     }
     /* Successfully bound and now also listening. */
     break;
   }
   freeaddrinfo(reslist);
+  if ((res == NULL) && (hints.ai_family != af)) {
+    // no IPv6, IPv4 only then
+    hints.ai_family = af;
+    goto retry;
+  }
   if (res == NULL)
     error("Listening socket failed.");
+  return lsock;
 }
 
-/// Buffer for receiving a single packet or datagram
-char buf[MAX_BUF];
-/// Buffer containing modified packet or datagram
-char b2[MAX_BUF];
+/// Bind and optionally listen to a unix socket for netsed server.
+/// A stale socket file of a previous run is replaced.
+/// @param sa  unix socket address.
+/// @param l   size of @a sa.
+/// @param tcp 1 stream, 0 datagram.
+/// @return the listening socket.
+int bind_unix(struct sockaddr_storage *sa, socklen_t l, int tcp) {
+  struct sockaddr_un *sun = (struct sockaddr_un *)sa;
+  int lsock = socket(AF_UNIX, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
 
-/// Applies the rules to global buffer buf.
-/// @param siz useful size of the data in buf.
-/// @param live TTL state of current connection.
-int sed_the_buffer(int siz, int* live) {
-  int i=0,j=0;
-  int newsize=0;
-  int changes=0;
-  int gotchange=0;
-  for (i=0;i<siz;) {
-    gotchange=0;
-    for (j=0;j<rules;j++) {
-      if ((!memcmp(&buf[i],rule[j].from,rule[j].fs)) && (live[j]!=0)) {
-        changes++;
-        gotchange=1;
-        printf("    Applying rule s/%s/%s...\n",rule[j].forig,rule[j].torig);
-        live[j]--;
-        if (live[j]==0) printf("    (rule just expired)\n");
-        memcpy(&b2[newsize],rule[j].to,rule[j].ts);
-        newsize+=rule[j].ts;
-        i+=rule[j].fs;
-        break;
-      }
-    }
-    if (!gotchange) {
-      b2[newsize]=buf[i];
-      if (isprint(buf[i])) 
-        printf("%c",buf[i]);
-      else 
-	printf(" ");
-      newsize++;
-      i++;
-      if (i%80 == 0) printf("\n");
-    }
+  if (lsock < 0) error("Listening socket failed.");
+  if (sun->sun_path[0]) unlink(sun->sun_path);
+  if (bind(lsock, (struct sockaddr *)sa, l) || (tcp && (listen_tcp(lsock, 0) < 0))) {
+    ERR("bind(): %s\n", strerror(errno));
+    close(lsock);
+    error("Listening socket failed.");
   }
-  if (!changes) printf("[*] Forwarding untouched packet of size %d.\n",siz);
-  else printf("[*] Done %d replacements, forwarding packet of size %d (orig %d).\n",
-              changes,newsize,siz);
-  return newsize;
+  return lsock;
 }
 
+/// Find or create the source of a set of rules.
+/// Sources without command line rules are shared by rule file.
+/// @param file     rule file, NULL if none.
+/// @param args     command line rules.
+/// @param nargs    number of @a args.
+/// @return the rule source, its rule set is loaded by main().
+struct rulesrc_s *rulesrc_get(const char *file, char **args, int nargs) {
+  struct rulesrc_s *src;
+  for (src = rulesrcs; src != NULL; src = src->n)
+    if (!nargs && !src->nargs && (file == src->file
+        || (file && src->file && !strcmp(file, src->file))))
+      return src;
+  src = calloc(1, sizeof(struct rulesrc_s));
+  if (NULL == src) error("netsed: unable to malloc() rule source");
+  src->file = file;
+  src->args = args;
+  src->nargs = nargs;
+  src->n = rulesrcs;
+  rulesrcs = src;
+  return src;
+}
 
-// Prototype this function so that the content is in the same order as in
-// previous read_write_sed function. (ease patch and diff)
-void b2server_sed(struct tracker_s * conn, ssize_t rd);
+/// Alternate the families of the addresses of a server, keeping their
+/// order: a broken ipv6 (or ipv4) path then only delays the next attempt,
+/// see backend_connect().
+/// @param addr  addresses.
+/// @param addrl sizes of @a addr.
+/// @param n     number of addresses.
+void addr_interleave(struct sockaddr_storage *addr, socklen_t *addrl, int n) {
+  int i, j;
+  for (i = 1; i < n; i++) {
+    if (addr[i].ss_family != addr[i-1].ss_family) continue;
+    for (j = i+1; (j < n) && (addr[j].ss_family == addr[i].ss_family); j++);
+    if (j < n) {
+      struct sockaddr_storage a = addr[j];
+      socklen_t al = addrl[j];
+      memmove(&addr[i+1], &addr[i], (j-i)*sizeof(*addr));
+      memmove(&addrl[i+1], &addrl[i], (j-i)*sizeof(*addrl));
+      addr[i] = a;
+      addrl[i] = al;
+    }
+  }
+}
 
-/// Receive a packet or datagram from the server, 'sed' it, send it to the
-/// client.
+/// Resolve the addresses of a server, keeping the families this host
+/// supports, in getaddrinfo() order.
+/// @param be   server, backend_s::host is set.
+/// @param tcp  1 tcp, 0 udp.
+/// @param port port of the server (rport).
+/// @return NULL or an error message.
+const char *backend_resolve(struct backend_s *be, int tcp, const char *port) {
+  int ret, n = 0;
+  struct addrinfo hints, *res, *reslist;
+  struct sockaddr_storage *addr;
+  socklen_t *addrl;
+
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = AI_CANONNAME;
+  hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
+
+  addr = malloc(sizeof(*addr));
+  addrl = malloc(sizeof(*addrl));
+  if (!addr || !addrl) goto nomem;
+  if (unix_addr(be->host, addr, addrl)) {
+    n = 1;
+    goto done;
+  }
+  if ((ret = getaddrinfo(be->host, port, &hints, &reslist))) {
+    free(addr);
+    free(addrl);
+    return gai_strerror(ret);
+  }
+  /* We have candidates for remote host. */
+  for (res = reslist; res; res = res->ai_next) {
+    int sd = -1;
+
+    if ( (sd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
+      continue;
+    close(sd);
+    /* Has successfully built a socket for this address family. */
+    /* Record the address structure and the port. */
+    if (n) {
+      addr = realloc(addr, (n+1)*sizeof(*addr));
+      addrl = realloc(addrl, (n+1)*sizeof(*addrl));
+      if (!addr || !addrl) {
+        freeaddrinfo(reslist);
+        goto nomem;
+      }
+    }
+    memcpy(&addr[n], res->ai_addr, res->ai_addrlen);
+    addrl[n++] = res->ai_addrlen;
+  }
+  freeaddrinfo(reslist);
+  if (!n) {
+    free(addr);
+    free(addrl);
+    return "no usable address";
+  }
+  addr_interleave(addr, addrl, n);
+done:
+  free(be->addr);
+  free(be->addrl);
+  be->addr = addr;
+  be->addrl = addrl;
+  be->naddr = n;
+  return NULL;
+nomem:
+  error("netsed: unable to malloc() server addresses");
+  return NULL;
+}
+
+/// Compare consistent hashing ring points for qsort().
+int cmp_ringpoint(const void *a, const void *b) {
+  uint32_t x = ((const struct ringpoint_s *)a)->h, y = ((const struct ringpoint_s *)b)->h;
+  return (x > y) - (x < y);
+}
+
+/// Add a listener: resolve where to forward and bind the listening socket.
+/// @param spec proto, lport, rhost and rport, kept by the listener.
+/// @param src  rules of the listener.
+void listener_add(char **spec, struct rulesrc_s *src) {
+  int i, af;
+  struct listener_s *ls, **pls;
+  struct sockaddr_storage sa;
+  socklen_t l;
+  char *hosts, *h, *save;
+
+  if (strcasecmp(spec[0],"tcp")*strcasecmp(spec[0],"udp")) usage_hints("incorrect protocol");
+  ls = calloc(1, sizeof(struct listener_s));
+  if (NULL == ls) error("netsed: unable to malloc() listener");
+  memcpy(ls->spec, spec, sizeof(ls->spec));
+  ls->tcp = strncasecmp(spec[0], "udp", 3);
+  ls->src = src;
+  ls->lsock = -1;
+  // append, so that clean_socks() closes it on error
+  for (pls = &listeners; *pls != NULL; pls = &(*pls)->n);
+  *pls = ls;
+
+  // rhost: comma separated servers
+  hosts = strdup(spec[2]);
+  if (NULL == hosts) error("netsed: unable to malloc() listener");
+  for (h = strtok_r(hosts, ",", &save); h; h = strtok_r(NULL, ",", &save)) {
+    struct backend_s *be;
+    const char *err;
+
+    ls->backends = realloc(ls->backends, (ls->nbackends+1)*sizeof(struct backend_s));
+    if (NULL == ls->backends) error("netsed: unable to malloc() servers");
+    be = &ls->backends[ls->nbackends];
+    memset(be, 0, sizeof(*be));
+    be->host = h;
+    be->probe = -1;
+    if ((err = backend_resolve(be, ls->tcp, spec[3]))) {
+      ERR("getaddrinfo(): %s: %s\n", h, err);
+      error("Impossible to resolve remote address or port.");
+    }
+    be->dns = -1;
+    if (be->addr[0].ss_family != AF_UNIX) {
+      struct in6_addr a;
+      ls->fixedport = get_port((struct sockaddr *)&be->addr[0]);
+      // names only: resolved again from the first loop
+      if (dnsserverl && (inet_pton(AF_INET, h, &a) <= 0) && (inet_pton(AF_INET6, h, &a) <= 0))
+        be->refresh = 1;
+    }
+    if (is_addr_any((struct sockaddr *)&be->addr[0])) {
+      // no fixed server: dynamic forwarding
+      if (ls->nbackends || strtok_r(NULL, ",", &save))
+        usage_hints("rhost 0 cannot be balanced with other servers");
+      free(be->addr);
+      free(be->addrl);
+      break;
+    }
+    ls->nbackends++;
+  }
+  if (!ls->nbackends) free(hosts);
+
+  if (ls->nbackends > 1)
+    printf("[+] Balancing (%s) between %d servers: %s,%s.\n", balance_name[balance],
+           ls->nbackends, spec[2], spec[3]);
+  else if (ls->nbackends && (ls->backends[0].addr[0].ss_family == AF_UNIX))
+    printf("[+] Using fixed forwarding to %s.\n",spec[2]);
+  else if (ls->nbackends && ls->fixedport)
+    printf("[+] Using fixed forwarding to %s,%s.\n",spec[2],spec[3]);
+  else if (ls->fixedport)
+    printf("[+] Using dynamic (transparent proxy) forwarding with fixed port %s.\n",spec[3]);
+  else if (ls->nbackends)
+    printf("[+] Using dynamic (transparent proxy) forwarding with fixed addr %s.\n",spec[2]);
+  else
+    printf("[+] Using dynamic (transparent proxy) forwarding.\n");
+
+  // family of the server, to decide on a dual stack listener
+  af = ls->nbackends ? ls->backends[0].addr[0].ss_family : 0;
+  if (unix_addr(spec[1], &sa, &l)) {
+    // no original destination on a unix socket
+    if (!ls->nbackends || ((af != AF_UNIX) && !ls->fixedport))
+      usage_hints("a unix socket listener needs fixed rhost and rport");
+    ls->lsock = bind_unix(&sa, l, ls->tcp);
+  } else {
+    ls->lsock = bind_and_listen((af == AF_UNIX) ? 0 : af, ls->tcp, spec[1]);
+  }
+  // the pool is only usable when all connections go to the same place
+  if (poolsz && ls->tcp && !keepsrc && (ls->nbackends == 1)
+      && (ls->fixedport || (af == AF_UNIX))) {
+    ls->pool = calloc(poolsz, sizeof(struct pooled_s));
+    if (NULL == ls->pool) error("netsed: unable to malloc() connection pool");
+    printf("[+] Keeping %d pre-connected connection%s to %s.\n", poolsz, (poolsz > 1) ? "s" : "",
+           addr_str((struct sockaddr *)&ls->backends[0].addr[0], ls->backends[0].addrl[0]));
+  }
+  if ((balance == SOURCEHASH) && (ls->nbackends > 1)) {
+    // each server owns the arcs ending at its points
+    ls->ring = malloc(ls->nbackends*BACKEND_POINTS*sizeof(struct ringpoint_s));
+    if (NULL == ls->ring) error("netsed: unable to malloc() hashing ring");
+    for (i = 0; i < ls->nbackends*BACKEND_POINTS; i++) {
+      char point[300];
+      snprintf(point, sizeof(point), "%s#%d", ls->backends[i/BACKEND_POINTS].host, i%BACKEND_POINTS);
+      ls->ring[i].h = fnv1a(point, strlen(point), 2166136261u);
+      ls->ring[i].be = i/BACKEND_POINTS;
+    }
+    qsort(ls->ring, ls->nbackends*BACKEND_POINTS, sizeof(struct ringpoint_s), cmp_ringpoint);
+  }
+}
+
+/// Start connecting the empty slots of the pool of a listener.
+/// After a failure nothing is tried for a second, see listener_s::pool_retry.
+/// @param ls listener with a pool.
+void pool_fill(struct listener_s *ls) {
+  int i, one = 1;
+  struct backend_s *be = &ls->backends[0];
+  for (i = 0; (i < poolsz) && (now >= ls->pool_retry); i++) {
+    struct pooled_s *p = &ls->pool[i];
+    if (p->state != EMPTY) continue;
+    if ((p->fd = socket(be->addr[0].ss_family, SOCK_STREAM, 0)) < 0) break;
+    fcntl(p->fd, F_SETFL, O_NONBLOCK);
+    setsockopt(p->fd, SOL_SOCKET, SO_OOBINLINE, &one, sizeof(int));
+    if (!connect(p->fd, (struct sockaddr *)&be->addr[0], be->addrl[0])) {
+      p->state = READY;
+    } else if (errno == EINPROGRESS) {
+      p->state = CONNECTING;
+    } else {
+      DBG("[!] pool connect failed: %s\n", strerror(errno));
+      close(p->fd);
+      ls->pool_retry = now + 1;
+    }
+  }
+}
+
+/// Add the sockets of the pool of a listener to the select() sets:
+/// connecting ones wait for writability, idle ones for data or EOF.
+/// @param ls   listener with a pool.
+/// @param rd   read set.
+/// @param wr   write set.
+/// @param nfds highest socket, updated.
+void pool_fdset(struct listener_s *ls, fd_set *rd, fd_set *wr, int *nfds) {
+  int i;
+  for (i = 0; i < poolsz; i++) {
+    struct pooled_s *p = &ls->pool[i];
+    if (p->state == CONNECTING) FD_SET(p->fd, wr);
+    else if (p->state == READY) FD_SET(p->fd, rd);
+    else continue;
+    if (*nfds < p->fd) *nfds = p->fd;
+  }
+}
+
+/// Check a pooled connection is still open, and move it to #GREETED if the
+/// server already sent something.
+/// @param p pooled connection, #READY or #GREETED.
+/// @return 1 if usable, 0 if it was closed (slot back to #EMPTY).
+int pool_alive(struct pooled_s *p) {
+  char c;
+  ssize_t rd = recv(p->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+  if (rd > 0) p->state = GREETED;
+  if ((rd > 0) || ((rd < 0) && (errno == EAGAIN))) return 1;
+  close(p->fd);
+  p->state = EMPTY;
+  return 0;
+}
+
+/// Handle select() results on the pool of a listener.
+/// @param ls listener with a pool.
+/// @param rd read set.
+/// @param wr write set.
+void pool_check(struct listener_s *ls, fd_set *rd, fd_set *wr) {
+  int i;
+  for (i = 0; i < poolsz; i++) {
+    struct pooled_s *p = &ls->pool[i];
+    if ((p->state == CONNECTING) && FD_ISSET(p->fd, wr)) {
+      int err = 0;
+      socklen_t l = sizeof(err);
+      getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &l);
+      if (err) {
+        DBG("[!] pool connect failed: %s\n", strerror(err));
+        close(p->fd);
+        p->state = EMPTY;
+        ls->pool_retry = now + 1;
+      } else {
+        p->state = READY;
+      }
+    } else if ((p->state == READY) && FD_ISSET(p->fd, rd)) {
+      // closed by the server, or early data kept for the client
+      pool_alive(p);
+    }
+  }
+}
+
+/// Take a connected socket from the pool of a listener.
+/// @param ls listener, with or without pool.
+/// @return a blocking connected socket, or -1 if none is ready.
+int pool_take(struct listener_s *ls) {
+  int i;
+  for (i = 0; ls->pool && (i < poolsz); i++) {
+    struct pooled_s *p = &ls->pool[i];
+    if (((p->state == READY) || (p->state == GREETED)) && pool_alive(p)) {
+      fcntl(p->fd, F_SETFL, 0);
+      p->state = EMPTY;
+      return p->fd;
+    }
+  }
+  return -1;
+}
+
+/// Read listeners from a configuration file (-c option).
+/// Each line is "proto lport rhost rport [rulefile]", empty lines and lines
+/// starting with '#' are ignored.
+/// @param path configuration file.
+/// @param def  rules of listeners without rule file.
+void config_load(const char *path, struct rulesrc_s *def) {
+  char *line = NULL;
+  size_t n = 0;
+  int lineno = 0;
+  FILE *f = fopen(path, "r");
+
+  if (!f) {
+    ERR("fopen(): %s\n", strerror(errno));
+    error("Cannot open configuration file.");
+  }
+  while (getline(&line, &n, f) > 0) {
+    char *spec[5], *tok;
+    int nspec = 0;
+
+    lineno++;
+    for (tok = strtok(line, " \t\r\n"); tok && (*tok != '#'); tok = strtok(NULL, " \t\r\n")) {
+      if (nspec == 5) { nspec++; break; }
+      if (NULL == (spec[nspec++] = strdup(tok))) error("netsed: unable to malloc() listener");
+    }
+    if (!nspec) continue;
+    if ((nspec < 4) || (nspec > 5)) {
+      ERR("%s:%d: expecting 'proto lport rhost rport [ rulefile ]'\n", path, lineno);
+      error("Invalid configuration file.");
+    }
+    listener_add(spec, (nspec == 5) ? rulesrc_get(spec[4], NULL, 0) : def);
+  }
+  free(line);
+  fclose(f);
+}
+
+/// Buffer for receiving a single packet or datagram, with room for the
+/// 64 bit loads of find_literal() at its end.
+char buf[MAX_BUF+8];
+/// Buffer containing modified packet or datagram
+char b2[MAX_BUF];
+
+/// Tell if rule @a r has not expired, for the connection and globally.
+#define RULE_LIVE(r) (((rule->ttl[r] < 0) || (live[rule->ttl[r]] != 0)) && (!rule->left[r] || (*rule->left[r] != 0)))
+
+/// Find the rule to apply at offset @a i of global buffer buf.
+/// This is the first not expired rule, in rule set order, whose pattern
+/// fully matches buf from @a i, and whose stream window contains the match,
+/// found by walking the rule set trie. With #MATCH_LONGEST the walk goes
+/// down to the deepest such rule: the longest pattern, the first of those.
+/// @param t    trie of the rules of the data direction.
+/// @param rule matcher arrays of the rule set.
+/// @param live TTL state of the connection.
+/// @param i    offset in buf.
+/// @param siz  useful size of the data in buf.
+/// @param pos  stream offset of buf.
+/// @return the rule index or -1.
+int match_rule(const struct trie_s *t, const struct rulehot_s *rule, const int *live,
+               int i, int siz, uint64_t pos) {
+  uint32_t n = t->root[(uint8_t)buf[i]];
+  int best = -1;
+
+  pos += i;
+  while (n) {
+    int32_t r;
+    // no better rule below, a longer one is always better
+    if ((best >= 0) && (t->match != MATCH_LONGEST) && (t->min[n] >= best)) break;
+    for (r = t->term[n]; r >= 0; r = t->next[r])
+      if (RULE_LIVE(r) && (pos >= rule->smin[r]) && (pos <= rule->smax[r])) {
+        if ((best < 0) || (r < best) || (t->match == MATCH_LONGEST)) best = r;
+        break;
+      }
+    if (++i >= siz) break;
+    n = trie_child(t, n, buf[i]);
+  }
+  return best;
+}
+
+/// Tell if rule @a r can be applied at stream offset @a pos.
+#define RULE_APPLIES(r, pos) (RULE_LIVE(r) && ((pos) >= rule->smin[r]) && ((pos) <= rule->smax[r]))
+
+/// Find the pattern of a rule in global buffer buf.
+/// @param rule matcher arrays of the rule set.
+/// @param o    rule index.
+/// @param i    lowest offset.
+/// @param lim  offset after the highest offset.
+/// @param siz  useful size of the data in buf.
+/// @return the first offset from @a i and before @a lim, or -1 if none.
+int find_pattern(const struct rulehot_s *rule, int o, int i, int lim, int siz) {
+  const char *p;
+  int fs = rule->fs[o];
+  int end = (lim + fs - 1 < siz) ? lim + fs - 1 : siz;
+  if (i + fs > end) return -1;
+  p = (fs == 1) ? memchr(buf+i, rule->from[o][0], end-i) : memmem(buf+i, end-i, rule->from[o], fs);
+  return p ? p - buf : -1;
+}
+
+/// Tell if rule @a j is chosen over rule @a k matching at the same offset.
+#define RULE_BEFORE(j, k) (((t->match == MATCH_LONGEST) && (rule->fs[j] != rule->fs[k])) \
+                           ? (rule->fs[j] > rule->fs[k]) : ((j) < (k)))
+
+/// Find the next offset of global buffer buf where a literal rule applies,
+/// with the algorithm chosen by plan_kernel(). At that offset the rule is
+/// the one match_rule() would find, in both match modes.
+/// @param t    matcher of the rules of the data direction.
+/// @param rule matcher arrays of the rule set.
+/// @param live TTL state of the connection.
+/// @param i    first offset to look at.
+/// @param siz  useful size of the data in buf.
+/// @param pos  stream offset of buf.
+/// @param r    set to the rule index when found.
+/// @param next #K_FEW: next offset of each rule of the matcher, to be set to
+///             -1 for each new buffer.
+/// @return the offset, or @a siz if no rule applies.
+int find_literal(const struct trie_s *t, const struct rulehot_s *rule, const int *live,
+                 int i, int siz, uint64_t pos, int *r, int *next) {
+  int k, best = siz;
+  switch (t->kernel) {
+    case K_NONE:
+      break;
+    case K_ONE: {
+      int o = t->krule[0];
+      if (!RULE_LIVE(o)) break;
+      while ((i = find_pattern(rule, o, i, siz, siz)) >= 0) {
+        if (pos + i > rule->smax[o]) break;
+        if (pos + i >= rule->smin[o]) {
+          *r = o;
+          return i;
+        }
+        i++;
+      }
+      break;
+    }
+    case K_PACKED:
+      for (;i<siz;i++) {
+        uint64_t w;
+        int found = -1;
+        if (!t->kfirst[(uint8_t)buf[i]]) continue;
+        // bytes past siz are masked out, and buf has room for them
+        memcpy(&w, buf+i, 8);
+        for (k=0;k<t->nk;k++) {
+          int j = t->krule[k];
+          if (((w & t->kmask[k]) == t->kpat[k]) && (i + rule->fs[j] <= siz)
+              && RULE_APPLIES(j, pos + i)) {
+            if ((found < 0) || (rule->fs[j] > rule->fs[found])) found = j;
+            // by increasing index: the first one wins, or a longer one
+            if (t->match != MATCH_LONGEST) break;
+          }
+        }
+        if (found >= 0) {
+          *r = found;
+          return i;
+        }
+      }
+      break;
+    case K_FEW:
+      // the earliest occurrence wins, then the lowest rule index, or the
+      // longest pattern with #MATCH_LONGEST
+      for (k=0;k<t->nk;k++) {
+        int j = t->krule[k], p = next[k];
+        // a longer pattern can still win at best itself
+        int lim = ((t->match == MATCH_LONGEST) && (best < siz)) ? best+1 : best;
+        if (!RULE_LIVE(j)) continue;
+        // no occurrence between i and a known one, siz if none at all
+        if (p < i) p = find_pattern(rule, j, i, lim, siz);
+        while ((p >= 0) && (p < siz) && !RULE_APPLIES(j, pos + p))
+          p = (pos + p > rule->smax[j]) ? siz : find_pattern(rule, j, p+1, lim, siz);
+        if (p < 0) {
+          // not before lim: unknown after it
+          next[k] = (best == siz) ? siz : -1;
+          continue;
+        }
+        next[k] = p;
+        if ((p < best) || ((p == best) && (p < siz) && RULE_BEFORE(j, *r))) {
+          best = p;
+          *r = j;
+        }
+      }
+      return best;
+    case K_HASH: {
+      int m = t->wlen, b = t->wblock;
+      while (i + m <= siz) {
+        const uint8_t *w = (const uint8_t *)buf + i;
+        unsigned int h = HASH_BLOCK(w + m - b, b), s = t->wshift[h];
+        uint32_t c;
+        uint16_t prefix;
+        int found = -1;
+        if (s) {
+          i += s;
+          continue;
+        }
+        // candidates by increasing index: the first verified one wins, or
+        // the longest with #MATCH_LONGEST, all the rules matching at i are
+        // candidates
+        prefix = w[0] | (w[1] << 8);
+        for (c=t->wstart[h];c<t->wstart[h+1];c++) {
+          int j = t->wrule[c];
+          if ((t->wprefix[c] == prefix) && (i + rule->fs[j] <= siz)
+              && ((found < 0) || (rule->fs[j] > rule->fs[found]))
+              && !memcmp(w, rule->from[j], rule->fs[j]) && RULE_APPLIES(j, pos + i)) {
+            found = j;
+            if (t->match != MATCH_LONGEST) break;
+          }
+        }
+        if (found >= 0) {
+          *r = found;
+          return i;
+        }
+        i++;
+      }
+      break;
+    }
+    case K_TRIE:
+      for (;i<siz;i++) {
+        if (!t->root[(uint8_t)buf[i]]) continue;
+        if ((*r = match_rule(t, rule, live, i, siz, pos)) >= 0) return i;
+      }
+      break;
+  }
+  return siz;
+}
+
+/// Find in global buffer buf a #RULE_MASKED or #RULE_NOCASE rule applying
+/// before a literal match, with the Shift-And automaton: a bit a pattern
+/// byte, all the patterns of a word move forward at once by byte of data.
+/// @param t    matcher of the rules of the data direction.
+/// @param rule matcher arrays of the rule set.
+/// @param live TTL state of the connection.
+/// @param i    first offset to look at.
+/// @param best offset of the literal match, @a siz if none.
+/// @param siz  useful size of the data in buf.
+/// @param pos  stream offset of buf.
+/// @param r    rule of the literal match, replaced when a masked rule
+///             applies before, or at the same offset with a lower index
+///             (#MATCH_FIRST) or a longer pattern (#MATCH_LONGEST).
+/// @return the offset of the match, or @a siz if none.
+int find_masked(const struct trie_s *t, const struct rulehot_s *rule, const int *live,
+                int i, int best, int siz, uint64_t pos, int *r) {
+  int w, p;
+  for (w=0;w<t->nmw;w++) {
+    const struct maskword_s *m = &t->mw[w];
+    uint64_t d = 0;
+    // a match ending later cannot start before best
+    for (p=i;(p<siz) && (p<best+m->mlen);p++) {
+      uint64_t e;
+      d = ((d << 1) | m->start) & m->b[(uint8_t)buf[p]];
+      for (e=d & m->end;e;e&=e-1) {
+        int j = m->rule[__builtin_ctzll(e)], s = p - rule->fs[j] + 1;
+        if (((s < best) || ((s == best) && RULE_BEFORE(j, *r))) && RULE_APPLIES(j, pos + s)) {
+          best = s;
+          *r = j;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+/// Find the next offset of global buffer buf where a rule applies, and
+/// the rule applying there: the first one, or the longest pattern with
+/// #MATCH_LONGEST. The offset is the same in both modes.
+/// @param t    matcher of the rules of the data direction.
+/// @param rule matcher arrays of the rule set.
+/// @param live TTL state of the connection.
+/// @param i    first offset to look at.
+/// @param siz  useful size of the data in buf.
+/// @param pos  stream offset of buf.
+/// @param r    set to the rule index when found.
+/// @param next see find_literal().
+/// @return the offset, or @a siz if no rule applies.
+int find_match(const struct trie_s *t, const struct rulehot_s *rule, const int *live,
+               int i, int siz, uint64_t pos, int *r, int *next) {
+  int m = find_literal(t, rule, live, i, siz, pos, r, next);
+  if (t->nmw) m = find_masked(t, rule, live, i, m, siz, pos, r);
+  return m;
+}
+
+/// Matches of the rules in a chunk of global buffer buf.
+struct chunk_s {
+  /// First offset where matches can start.
+  int from;
+  /// Offset after the last one where matches can start.
+  int to;
+  /// End of the data looked at, the longest pattern after #to.
+  int end;
+  /// Number of matches.
+  int n;
+  /// Allocated size of #off and #rule.
+  int cap;
+  /// Offsets of the matches.
+  int *off;
+  /// Rules of the matches.
+  int *rule;
+  /// Set when #off or #rule could not be allocated.
+  int failed;
+};
+
+/// Worker threads scanning chunks of large buffers, see parallel_scan().
+/// The threads only read the rule set, buf and the TTL state, which does
+/// not change while they run.
+struct scanpool_s {
+  /// Worker threads.
+  pthread_t *thr;
+  /// Protects the other fields.
+  pthread_mutex_t lock;
+  /// Signaled when a new buffer is to be scanned.
+  pthread_cond_t go;
+  /// Signaled when all the chunks are scanned.
+  pthread_cond_t done;
+  /// Incremented for each buffer.
+  unsigned int job;
+  /// Number of chunks of the buffer, scanthreads + 1.
+  int nchunks;
+  /// Next chunk to scan.
+  int next;
+  /// Chunks not scanned yet.
+  int pending;
+  /// Chunks of the buffer.
+  struct chunk_s *chunk;
+  /// Matches of the whole buffer, merged from the chunks.
+  struct chunk_s merged;
+  /// Matcher of the buffer direction.
+  const struct trie_s *t;
+  /// Matcher arrays of the rule set.
+  const struct rulehot_s *rule;
+  /// TTL state of the connection.
+  const int *live;
+  /// Stream offset of buf.
+  uint64_t pos;
+} scanpool = { .lock = PTHREAD_MUTEX_INITIALIZER, .go = PTHREAD_COND_INITIALIZER,
+               .done = PTHREAD_COND_INITIALIZER };
+
+/// Add a match to a chunk.
+/// @return 0 on allocation failure.
+int chunk_push(struct chunk_s *k, int off, int rule) {
+  if (k->n == k->cap) {
+    int cap = k->cap ? 2*k->cap : 256;
+    int *o = realloc(k->off, cap*sizeof(int)), *r;
+    if (!o) return 0;
+    k->off = o;
+    r = realloc(k->rule, cap*sizeof(int));
+    if (!r) return 0;
+    k->rule = r;
+    k->cap = cap;
+  }
+  k->off[k->n] = off;
+  k->rule[k->n++] = rule;
+  return 1;
+}
+
+/// Find the matches starting in a chunk, as sed_the_buffer() would from the
+/// start of the chunk.
+void scan_chunk(struct chunk_s *k) {
+  const struct scanpool_s *p = &scanpool;
+  int next[FEW_RULES];
+  int i = k->from, m, r;
+
+  memset(next, 0xff, sizeof(next));
+  k->n = 0;
+  k->failed = 0;
+  while ((m = find_match(p->t, p->rule, p->live, i, k->end, p->pos, &r, next)) < k->to) {
+    if (!chunk_push(k, m, r)) {
+      k->failed = 1;
+      return;
+    }
+    i = m + p->rule->fs[r];
+  }
+}
+
+/// Scan the chunks left of the current buffer, with scanpool.lock held.
+void scan_chunks(void) {
+  while (scanpool.next < scanpool.nchunks) {
+    struct chunk_s *k = &scanpool.chunk[scanpool.next++];
+    pthread_mutex_unlock(&scanpool.lock);
+    scan_chunk(k);
+    pthread_mutex_lock(&scanpool.lock);
+    if (--scanpool.pending == 0) pthread_cond_signal(&scanpool.done);
+  }
+}
+
+/// Worker thread of the scan pool.
+void *scan_worker(void *arg) {
+  unsigned int job = 0;
+  pthread_mutex_lock(&scanpool.lock);
+  for (;;) {
+    while (scanpool.job == job) pthread_cond_wait(&scanpool.go, &scanpool.lock);
+    job = scanpool.job;
+    scan_chunks();
+  }
+  return NULL;
+}
+
+/// Start the -j worker threads.
+void scanpool_start(void) {
+  int i;
+  if (!scanthreads) return;
+  scanpool.nchunks = scanthreads + 1;
+  scanpool.thr = calloc(scanthreads, sizeof(pthread_t));
+  scanpool.chunk = calloc(scanpool.nchunks, sizeof(struct chunk_s));
+  if (!scanpool.thr || !scanpool.chunk) error("netsed: unable to malloc() scan threads");
+  for (i=0;i<scanthreads;i++)
+    if (pthread_create(&scanpool.thr[i], NULL, scan_worker, NULL))
+      error("netsed: pthread_create() failed");
+  printf("[+] Scanning buffers of %d bytes or more with %d threads.\n", scanmin, scanthreads+1);
+}
+
+/// Find all the matches of global buffer buf in chunks scanned at the same
+/// time, when the buffer is large enough and no TTL can change during the
+/// scan. The chunks overlap by the longest pattern - 1. The matches of each
+/// chunk are right once a match of the previous chunks ends before the
+/// chunk start, or at one of its matches: until then the matches are
+/// searched again from the end of the previous one.
+/// @param t    matcher of the rules of the data direction.
+/// @param rule matcher arrays of the rule set.
+/// @param live TTL state of the connection.
+/// @param siz  useful size of the data in buf.
+/// @param pos  stream offset of buf.
+/// @return the number of matches in scanpool.merged, -1 if not scanned.
+int parallel_scan(const struct trie_s *t, const struct rulehot_s *rule, const int *live,
+                  int siz, uint64_t pos) {
+  struct chunk_s *all = &scanpool.merged;
+  int c, e = 0;
+
+  if (!scanthreads || (siz < scanmin) || t->finite || ((t->kernel == K_NONE) && !t->nmw))
+    return -1;
+  pthread_mutex_lock(&scanpool.lock);
+  scanpool.t = t;
+  scanpool.rule = rule;
+  scanpool.live = live;
+  scanpool.pos = pos;
+  for (c=0;c<scanpool.nchunks;c++) {
+    struct chunk_s *k = &scanpool.chunk[c];
+    k->from = (int64_t)siz * c / scanpool.nchunks;
+    k->to = (int64_t)siz * (c+1) / scanpool.nchunks;
+    k->end = (k->to + t->longest - 1 < siz) ? k->to + t->longest - 1 : siz;
+  }
+  scanpool.next = 0;
+  scanpool.pending = scanpool.nchunks;
+  scanpool.job++;
+  pthread_cond_broadcast(&scanpool.go);
+  scan_chunks();
+  while (scanpool.pending) pthread_cond_wait(&scanpool.done, &scanpool.lock);
+  pthread_mutex_unlock(&scanpool.lock);
+
+  all->n = 0;
+  for (c=0;c<scanpool.nchunks;c++) {
+    struct chunk_s *k = &scanpool.chunk[c];
+    int x = 0;
+    if (k->failed) return -1;
+    while (e < k->to) {
+      int next[FEW_RULES], m, r, lim;
+      while ((x < k->n) && (k->off[x] < e)) x++;
+      if (e > k->from) {
+        // the next match is at the next one of the chunk at the latest
+        lim = (x < k->n) ? k->off[x] + t->longest : k->end;
+        memset(next, 0xff, sizeof(next));
+        m = find_match(t, rule, live, e, (lim < siz) ? lim : siz, pos, &r, next);
+        if (m >= k->to) break;
+        if ((x == k->n) || (m != k->off[x])) {
+          if (!chunk_push(all, m, r)) return -1;
+          e = m + rule->fs[r];
+          continue;
+        }
+      }
+      // same start as the chunk: its matches are right
+      for (;x<k->n;x++) {
+        if (!chunk_push(all, k->off[x], k->rule[x])) return -1;
+        e = k->off[x] + rule->fs[k->rule[x]];
+      }
+      break;
+    }
+  }
+  stats.parallel++;
+  return all->n;
+}
+
+/// Print forwarded data, non printable bytes as spaces, with a new line
+/// every 80 bytes of the buffer.
+/// @param p    data.
+/// @param from offset of the first byte in the buffer.
+/// @param to   offset after the last byte.
+void print_data(const char *p, int from, int to) {
+  char line[2*MAX_BUF/80+MAX_BUF+2];
+  int l = 0;
+  for (;from<to;from++) {
+    line[l++] = isprint(*p) ? *p : ' ';
+    p++;
+    if ((from+1)%80 == 0) line[l++] = '\n';
+  }
+  fwrite(line, 1, l, stdout);
+}
+
+/// Applies the rules to global buffer buf. As long as the rules applied
+/// keep the length of the data, buf is patched in place; the first rule
+/// changing it moves the data to b2.
+/// @param siz useful size of the data in buf.
+/// @param conn connection giving the rule set and its TTL state.
+/// @param dir direction of the data, only the rules of this direction apply.
+/// @param out set to the buffer to send: b2, or buf when it is forwarded
+///            without copy.
+/// @return the size of the data to send.
+int sed_the_buffer(int siz, struct tracker_s * conn, enum dir_e dir, char **out) {
+  int i=0,j=0;
+  int newsize=0;
+  int changes=0;
+  int inplace=1;
+  int par, x=0;
+  int next[FEW_RULES];
+  int *live;
+  struct rule_s *rule;
+  uint64_t pos;
+
+  rebind_ruleset(conn);
+  rule=conn->rs->rule;
+  live=conn->live;
+  // udp: rule windows are relative to each datagram
+  pos=(conn->csa == NULL) ? conn->pos[dir] : 0;
+  conn->pos[dir]+=siz;
+  if (pos >= conn->rs->trie[dir].horizon) {
+    // past the windows of all rules: nothing to look for
+    printf("[*] Forwarding packet of size %d past rule windows.\n",siz);
+    stats.untouched++;
+    *out=buf;
+    return siz;
+  }
+  memset(next, 0xff, sizeof(next));
+  par=parallel_scan(&conn->rs->trie[dir], &conn->rs->hot, live, siz, pos);
+  for (i=0;i<siz;) {
+    int m;
+    if (par < 0) m=find_match(&conn->rs->trie[dir], &conn->rs->hot, live, i, siz, pos, &j, next);
+    else if (x < par) {
+      m=scanpool.merged.off[x];
+      j=scanpool.merged.rule[x++];
+    } else m=siz;
+    print_data(&buf[i], i, m);
+    // in place, the data before the match is already where it should be
+    if (!inplace) memcpy(&b2[newsize], &buf[i], m-i);
+    newsize+=m-i;
+    i=m;
+    if (i<siz) {
+      // a #RULE_GLOBAL rule found has uses left: only this thread changes
+      // the counts, and never between find_match() and here (rule sets
+      // with such rules are not scanned in parallel); the decrement is
+      // atomic as the scan threads share the memory of the counts
+      int left=rule[j].left ? __atomic_sub_fetch(rule[j].left, 1, __ATOMIC_RELAXED) : -1;
+      changes++;
+      printf("    Applying rule s/%s/%s...\n",conn->rs->str[j].forig,conn->rs->str[j].torig);
+      if (rule[j].ttl >= 0) {
+        if (live == conn->rs->ttl) {
+          // first change: the connection gets its own counters
+          live = malloc(conn->rs->nttl*sizeof(int));
+          if(NULL == live) error("netsed: unable to malloc() connection TTL");
+          memcpy(live, conn->rs->ttl, conn->rs->nttl*sizeof(int));
+          conn->live = live;
+        }
+        if (--live[rule[j].ttl]==0) printf("    (rule just expired)\n");
+      }
+      if (left==0) printf("    (rule just expired for all connections)\n");
+      if (inplace && (rule[j].ts != rule[j].fs)) {
+        // the length changes: move what is done to b2
+        inplace=0;
+        memcpy(b2, buf, newsize);
+      }
+      // in place, the match is never looked at again
+      memcpy((inplace ? buf : b2)+newsize,rule[j].to,rule[j].ts);
+      newsize+=rule[j].ts;
+      i+=rule[j].fs;
+    }
+  }
+  *out=inplace ? buf : b2;
+  if (!changes) {
+    printf("[*] Forwarding untouched packet of size %d.\n",siz);
+    stats.untouched++;
+  } else if (inplace) {
+    printf("[*] Done %d replacements in place, forwarding packet of size %d.\n",
+           changes,newsize);
+    stats.inplace++;
+  } else {
+    printf("[*] Done %d replacements, forwarding packet of size %d (orig %d).\n",
+           changes,newsize,siz);
+    stats.copied++;
+  }
+  return newsize;
+}
+
+
+// Prototype this function so that the content is in the same order as in
+// previous read_write_sed function. (ease patch and diff)
+void b2server_sed(struct tracker_s * conn, ssize_t rd);
+
+/// Handle the end of the data of one direction. For tcp the receiving side
+/// is shut down for writing, after all the data already forwarded to it,
+/// and the connection lasts until the other direction ends too.
+/// @param conn connection.
+/// @param dir  direction that ended, #C2S or #S2C.
+void half_close(struct tracker_s *conn, enum dir_e dir) {
+  if (!conn->ls->tcp) {
+    conn->state = DISCONNECTED;
+    return;
+  }
+  conn->eof[dir] = 1;
+  if (conn->eof[!dir]) {
+    conn->state = DISCONNECTED;
+    return;
+  }
+  printf("[*] %s closed its side, forwarding the other one.\n", (dir == C2S) ? "Client" : "Server");
+  if (shutdown((dir == C2S) ? conn->fsock : conn->csock, SHUT_WR))
+    conn->state = DISCONNECTED;
+}
+
+/// Receive a packet or datagram from the server, 'sed' it, send it to the
+/// client.
 /// @param conn connection giving the sockets to use.
 void server2client_sed(struct tracker_s * conn) {
     ssize_t rd;
-    rd=read(conn->fsock,buf,sizeof(buf));
+    rd=read(conn->fsock,buf,MAX_BUF);
     if ((rd<0) && (errno!=EAGAIN))
     {
       DBG("[!] server disconnected. (rd err) %s\n",strerror(errno));
@@ -523,14 +3145,15 @@ void server2client_sed(struct tracker_s * conn) {
     if (rd == 0) {
       // nothing read but select said ok, so EOF
       DBG("[!] server disconnected. (rd)\n");
-      conn->state = DISCONNECTED;
+      half_close(conn, S2C);
     }
     if (rd>0) {
+      char *out;
       printf("[+] Caught server -> client packet.\n");
-      rd=sed_the_buffer(rd, conn->live);
+      rd=sed_the_buffer(rd, conn, S2C, &out);
       conn->time = now;
       conn->state = ESTABLISHED;
-      if (sendto(conn->csock,b2,rd,0,conn->csa, conn->csl)<=0) {
+      if (sendto(conn->csock,out,rd,0,conn->csa, conn->csl)<=0) {
         DBG("[!] client disconnected. (wr)\n");
         conn->state = DISCONNECTED;
       }
@@ -541,7 +3164,7 @@ void server2client_sed(struct tracker_s * conn) {
 /// @param conn connection giving the sockets to use.
 void client2server_sed(struct tracker_s * conn) {
     ssize_t rd;
-    rd=read(conn->csock,buf,sizeof(buf));
+    rd=read(conn->csock,buf,MAX_BUF);
     if ((rd<0) && (errno!=EAGAIN))
     {
       DBG("[!] client disconnected. (rd err)\n");
@@ -550,7 +3173,7 @@ void client2server_sed(struct tracker_s * conn) {
     if (rd == 0) {
       // nothing read but select said ok, so EOF
       DBG("[!] client disconnected. (rd)\n");
-      conn->state = DISCONNECTED;
+      half_close(conn, C2S);
     }
     b2server_sed(conn, rd);
 }
@@ -560,16 +3183,159 @@ void client2server_sed(struct tracker_s * conn) {
 /// @param rd   size of b2 content.
 void b2server_sed(struct tracker_s * conn, ssize_t rd) {
     if (rd>0) {
+      char *out;
       printf("[+] Caught client -> server packet.\n");
-      rd=sed_the_buffer(rd, conn->live);
+      rd=sed_the_buffer(rd, conn, C2S, &out);
       conn->time = now;
-      if (write(conn->fsock,b2,rd)<=0) {
+      if (write(conn->fsock,out,rd)<=0) {
         DBG("[!] server disconnected. (wr)\n");
         conn->state = DISCONNECTED;
       }
     }
 }
 
+/// Compile a rule file, for "netsed compile rules.txt -o rules.db".
+/// Exits when done.
+/// @param argc arguments count, argv[1] is "compile".
+/// @param argv arguments.
+void compile_rules(int argc, char *argv[]) {
+  struct ruleset_s *rs;
+  const char *err;
+
+  if ((argc != 5) || strcmp(argv[3], "-o")) usage_hints("usage: netsed compile rulefile -o compiledfile");
+  rs = ruleset_load(argv[2], NULL, 0, &err);
+  if (!rs) error(err);
+  if ((err = ruleset_write(rs, argv[4]))) error(err);
+  printf("[+] Compiled %d rule%s to %s.\n", rs->rules, (rs->rules > 1) ? "s" : "", argv[4]);
+  ruleset_release(rs);
+  exit(0);
+}
+
+/// Names of the matching algorithms, by kernel_e.
+const char *kernel_name[] = { "none", "one", "packed", "few", "hash", "trie" };
+
+/// Time find_match() on global buffer buf with one matching algorithm.
+/// @param rs    rule set, whose #C2S matcher runs @a k.
+/// @param k     matching algorithm.
+/// @param secs  duration of the measure.
+/// @param found set to the number of matches in buf.
+/// @return the speed in MB/s.
+double bench_kernel(struct ruleset_s *rs, enum kernel_e k, double secs, long *found) {
+  struct timespec t0, t1;
+  double el = 0;
+  long loops = 0;
+  int i, m, r;
+
+  rs->trie[C2S].kernel = k;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (el < secs) {
+    int next[FEW_RULES];
+    memset(next, 0xff, sizeof(next));
+    *found = 0;
+    for (i=0;(m = find_match(&rs->trie[C2S], &rs->hot, rs->ttl, i, MAX_BUF, 0, &r, next)) < MAX_BUF;
+         i = m + rs->hot.fs[r])
+      (*found)++;
+    loops++;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    el = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  }
+  return loops * (double)MAX_BUF / el / 1e6;
+}
+
+/// Measure the match modes with dense hits, see bench_kernels(): rules
+/// ab, aba, abab and ababa on data made of ab runs.
+/// @param secs duration of each measure.
+void bench_dense(double secs) {
+  static const char *rules[] = { "s/ab/X", "s/aba/X", "s/abab/X", "s/ababa/X" };
+  struct ruleset_s *rs = calloc(1, sizeof(struct ruleset_s));
+  enum match_e mode;
+  const char *err;
+  unsigned int k;
+  int i;
+
+  if (!rs) error("netsed: unable to malloc() rule set");
+  rs->refs = 1;
+  for (i=0;i<4;i++)
+    if ((err = ruleset_add(rs, rules[i]))) error(err);
+  if ((err = ruleset_compile(rs))) error(err);
+  if (!rs->trie[C2S].wmem && (err = hash_compile(rs, C2S, 2))) error(err);
+  for (i=0;i<MAX_BUF;i++) buf[i] = (rand() % 8) ? "ab"[i % 2] : 'c';
+  printf("\ndense hits, 4 rules of 2 to 5 bytes\nmode    ");
+  for (k=K_PACKED;k<=K_TRIE;k++) printf(" %9s MB/s", kernel_name[k]);
+  printf("\n");
+  for (mode=MATCH_FIRST;mode<=MATCH_LONGEST;mode++) {
+    long found[K_TRIE+1];
+    rs->trie[C2S].match = mode;
+    printf("%-8s", (mode == MATCH_FIRST) ? "first" : "longest");
+    for (k=K_PACKED;k<=K_TRIE;k++) {
+      printf(" %14.1f", bench_kernel(rs, k, secs, &found[k]));
+      if (found[k] != found[K_PACKED]) error("netsed: matching algorithms disagree");
+    }
+    printf("\n");
+  }
+  ruleset_release(rs);
+}
+
+/// Measure the matching algorithms, for "netsed bench [seconds]". For sets
+/// of 1 to 65536 rules of 1 to 64 bytes, prints the speed of find_match() with
+/// each algorithm able to run them, on random lowercase data, and the one
+/// plan_kernel() chooses. Then with dense hits, overlapping rules matching
+/// at most offsets, the speed in both match modes. Exits with an error if
+/// the algorithms disagree.
+void bench_kernels(int argc, char *argv[]) {
+  static const int nrules[] = { 1, 2, 3, 4, 8, 16, 256, 4096, 65536 }, lens[] = { 1, 2, 4, 8, 16, 64 };
+  double secs = (argc > 2) ? atof(argv[2]) : 0.1;
+  unsigned int a, b, k, i;
+
+  srand(1);
+  for (i=0;i<MAX_BUF;i++) buf[i] = 'a' + rand() % 26;
+  printf("rules  len");
+  for (k=K_ONE;k<=K_TRIE;k++) printf(" %9s MB/s", kernel_name[k]);
+  printf("  planned\n");
+  for (a=0;a<sizeof(nrules)/sizeof(int);a++)
+    for (b=0;b<sizeof(lens)/sizeof(int);b++) {
+      struct ruleset_s *rs = calloc(1, sizeof(struct ruleset_s));
+      enum kernel_e planned;
+      long found[K_TRIE+1] = { -1, -1, -1, -1, -1, -1 };
+      const char *err;
+      int r;
+
+      if (!rs) error("netsed: unable to malloc() rule set");
+      rs->refs = 1;
+      for (r=0;r<nrules[a];r++) {
+        char rule[80] = "s/";
+        // patterns taken from the data, so that they are found
+        memcpy(rule+2, buf + rand() % (MAX_BUF-64), lens[b]);
+        strcpy(rule+2+lens[b], "/X");
+        if ((err = ruleset_add(rs, rule))) error(err);
+      }
+      if ((err = ruleset_compile(rs))) error(err);
+      planned = rs->trie[C2S].kernel;
+      printf("%5d %4d", nrules[a], lens[b]);
+      for (k=K_ONE;k<=K_TRIE;k++) {
+        if (((k == K_ONE) && (nrules[a] != 1))
+            || ((k == K_PACKED) && ((nrules[a] > PACKED_RULES) || (lens[b] > 8)))
+            || ((k == K_FEW) && (nrules[a] > FEW_RULES))
+            || ((k == K_HASH) && (lens[b] < 2))) {
+          printf(" %14s", "-");
+          continue;
+        }
+        if ((k == K_HASH) && !rs->trie[C2S].wmem
+            && (err = hash_compile(rs, C2S, lens[b]))) error(err);
+        printf(" %14.1f", bench_kernel(rs, k, secs, &found[k]));
+        if (((found[K_ONE] >= 0) && (found[k] != found[K_ONE]))
+            || ((found[K_PACKED] >= 0) && (found[k] != found[K_PACKED]))
+            || ((found[K_FEW] >= 0) && (found[k] != found[K_FEW]))
+            || ((found[K_HASH] >= 0) && (found[k] != found[K_HASH])))
+          error("netsed: matching algorithms disagree");
+      }
+      printf("  %s\n", kernel_name[planned]);
+      ruleset_release(rs);
+    }
+  bench_dense(secs);
+  exit(0);
+}
+
 /// Handle SIGINT signal for clean exit.
 void sig_int(int signo)
 {
@@ -577,146 +3343,1008 @@ void sig_int(int signo)
   stop = 1;
 }
 
+/// Handle SIGHUP signal to reload rules.
+void sig_hup(int signo)
+{
+  reload = 1;
+}
+
+/// Handle SIGUSR1 signal to print statistics.
+void sig_usr1(int signo)
+{
+  dump = 1;
+}
+
+/// Print the statistics counters.
+void print_stats(void) {
+  struct rulesrc_s *src;
+  int open = 0, i;
+  struct tracker_s *conn;
+  for (conn = connections; conn != NULL; conn = conn->n) open++;
+  printf("[*] Stats: %lu connections, %d open, %lu idle tcp closed, %lu udp expired.\n",
+         stats.conns, open, stats.reaped, stats.expired);
+  for (src = rulesrcs; src != NULL; src = src->n)
+    for (i=0;i<src->rs->rules;i++)
+      if (src->rs->rule[i].left)
+        printf("[*] Stats: rule %s has %d uses left.\n", src->rs->str[i].text,
+               __atomic_load_n(src->rs->rule[i].left, __ATOMIC_RELAXED));
+  printf("[*] Stats: %lu packets untouched, %lu rewritten in place, %lu rewritten by copy, "
+         "%lu scanned in parallel.\n", stats.untouched, stats.inplace, stats.copied, stats.parallel);
+}
+
+/// Set the -k and -u options on a tcp socket.
+/// @param sd connected socket.
+void set_keepalive(int sd) {
+  int one = 1;
+  if (keepalive[0]) {
+    setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef TCP_KEEPIDLE
+    setsockopt(sd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive[0], sizeof(int));
+    if (keepalive[1]) setsockopt(sd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive[1], sizeof(int));
+    if (keepalive[2]) setsockopt(sd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive[2], sizeof(int));
+#endif
+  }
+#ifdef TCP_USER_TIMEOUT
+  if (usertimeout) setsockopt(sd, IPPROTO_TCP, TCP_USER_TIMEOUT, &usertimeout, sizeof(int));
+#endif
+}
+
+/// Receive a datagram on an udp listening socket, with its original
+/// destination in TPROXY mode.
+/// @param sd    listening socket.
+/// @param from  set to the client address.
+/// @param froml size of @a from, updated.
+/// @param to    set to the original destination, unchanged if unknown.
+/// @param tol   size of @a to, updated.
+/// @return the size of the datagram in buf, or -1.
+ssize_t recv_datagram(int sd, struct sockaddr_storage *from, socklen_t *froml,
+                      struct sockaddr_storage *to, socklen_t *tol) {
+#ifdef TPROXY
+  if (tproxy) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char ctl[256];
+    ssize_t rd;
+
+    iov.iov_base = buf;
+    iov.iov_len = MAX_BUF;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = *froml;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    if ((rd = recvmsg(sd, &msg, 0)) < 0) return rd;
+    *froml = msg.msg_namelen;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_ORIGDSTADDR)) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)CMSG_DATA(cmsg);
+        if (from->ss_family == AF_INET6) {
+          // IPv4 on a dual stack socket, same family as the socket
+          struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)to;
+          memset(sin6, 0, sizeof(*sin6));
+          sin6->sin6_family = AF_INET6;
+          sin6->sin6_port = sin->sin_port;
+          sin6->sin6_addr.s6_addr[10] = sin6->sin6_addr.s6_addr[11] = 0xff;
+          memcpy(&sin6->sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+          *tol = sizeof(*sin6);
+        } else {
+          memcpy(to, sin, sizeof(*sin));
+          *tol = sizeof(*sin);
+        }
+      }
+      if ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_ORIGDSTADDR)) {
+        memcpy(to, CMSG_DATA(cmsg), sizeof(struct sockaddr_in6));
+        *tol = sizeof(struct sockaddr_in6);
+      }
+    }
+    return rd;
+  }
+#endif
+  return recvfrom(sd,buf,MAX_BUF,0,(struct sockaddr*)from,froml);
+}
+
+/// Bind a socket to the address of a client, to connect to the server from
+/// there (-s option). The client port is kept when possible.
+/// @param sd  forwarding socket, not yet connected.
+/// @param sa  client address.
+/// @param l   size of @a sa.
+/// @return 0, or -1 with errno set.
+int bind_source(int sd, struct sockaddr *sa, socklen_t l) {
+  int one = 1;
+  if (set_transparent(sd, sa->sa_family)) return -1;
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (!bind(sd, sa, l)) return 0;
+  if (errno != EADDRINUSE) return -1;
+  // port used by the client itself on this host: address only
+  set_port(sa, 0);
+  return bind(sd, sa, l);
+}
+
+/// Open the forwarding socket of a connection, not yet connected.
+/// @param ls   listener of the connection.
+/// @param af   family of the server address.
+/// @param from client address.
+/// @param froml size of @a from.
+/// @return socket, or -1.
+int forward_socket(struct listener_s *ls, int af, struct sockaddr *from, socklen_t froml) {
+  // connect will bind with some dynamic addr/port
+  int sd = socket(af, ls->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+  if (sd < 0) return -1;
+  if ((af == AF_UNIX) && !ls->tcp) {
+    // unix datagrams: autobind an abstract address to get the replies
+    sa_family_t unixaf = AF_UNIX;
+    bind(sd, (struct sockaddr *)&unixaf, sizeof(unixaf));
+  }
+  if (keepsrc && bind_source(sd, from, froml))
+    printf("[!] Cannot connect from client address: %s.\n", strerror(errno));
+  return sd;
+}
+
+/// Open the forwarding socket of a connection and connect it.
+/// @param ls   listener of the connection.
+/// @param sa   where to forward.
+/// @param l    size of @a sa.
+/// @param from client address.
+/// @param froml size of @a from.
+/// @return connected socket, or -1.
+int forward_connect(struct listener_s *ls, struct sockaddr *sa, socklen_t l,
+                    struct sockaddr *from, socklen_t froml) {
+  int sd = forward_socket(ls, sa->sa_family, from, froml);
+  if (sd < 0) return -1;
+  if (connect(sd, sa, l)) {
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+/// Record the result of a health probe or of a connection to a server,
+/// and report when its state changes.
+/// @param be server.
+/// @param up 1 if the server answered, 0 otherwise.
+void backend_probed(struct backend_s *be, int up) {
+  if (up && be->down) {
+    printf("[+] Server %s is up.\n", be->host);
+    be->down = 0;
+  } else if (!up) {
+    if (!be->down) printf("[!] Server %s is down.\n", be->host);
+    be->down = now;
+  }
+}
+
+/// Tell if a server should get connections. Without health probes a down
+/// server is tried again after #BACKEND_DOWN seconds.
+/// @param be server.
+int backend_usable(struct backend_s *be) {
+  return !be->down || (!probeint && (now - be->down >= BACKEND_DOWN));
+}
+
+/// Connect to a server, trying each of its addresses. For tcp the
+/// attempts race: the next address is tried when the previous attempts did
+/// not finish within #CONNECT_DELAY or failed, the first connection
+/// established wins and the others are cancelled.
+/// @param ls    listener of the connection.
+/// @param be    server.
+/// @param conpo port, used for the servers given without rport.
+/// @param from  client address.
+/// @param froml size of @a from.
+/// @return connected (blocking) socket, or -1.
+int backend_connect(struct listener_s *ls, struct backend_s *be, in_port_t conpo,
+                    struct sockaddr *from, socklen_t froml) {
+  int i, started = 0, running = 0, sd = -1;
+  int att[be->naddr];
+  struct timeval delay;
+
+  while ((sd < 0) && ((started < be->naddr) || running)) {
+    fd_set wr_set;
+    int nfds = 0, sel;
+
+    // start an attempt: at first, after the delay, or when all failed
+    if ((started < be->naddr) && (!running || !delay.tv_usec)) {
+      struct sockaddr_storage s;
+      memcpy(&s, &be->addr[started], be->addrl[started]);
+      set_port((struct sockaddr *) &s, conpo);
+      printf("[*] Forwarding connection to %s\n", addr_str((struct sockaddr *) &s, be->addrl[started]));
+      if (!ls->tcp || (be->naddr == 1)) {
+        // nothing to race
+        sd = forward_connect(ls, (struct sockaddr *) &s, be->addrl[started], from, froml);
+        att[started++] = -1;
+        continue;
+      }
+      att[started] = forward_socket(ls, s.ss_family, from, froml);
+      if (att[started] >= 0) {
+        fcntl(att[started], F_SETFL, O_NONBLOCK);
+        if (!connect(att[started], (struct sockaddr *) &s, be->addrl[started])) {
+          sd = att[started];
+        } else if (errno == EINPROGRESS) {
+          running++;
+        } else {
+          close(att[started]);
+          att[started] = -1;
+        }
+      }
+      started++;
+      delay.tv_sec = 0;
+      delay.tv_usec = CONNECT_DELAY*1000;
+      continue;
+    }
+
+    FD_ZERO(&wr_set);
+    for (i = 0; i < started; i++) {
+      if (att[i] < 0) continue;
+      FD_SET(att[i], &wr_set);
+      if (nfds < att[i]) nfds = att[i];
+    }
+    // select() updates delay with the time left, 0 starts the next attempt
+    sel = select(nfds+1, NULL, &wr_set, NULL, (started < be->naddr) ? &delay : NULL);
+    if ((sel < 0) && (errno != EINTR)) break;
+    for (i = 0; (sel > 0) && (sd < 0) && (i < started); i++) {
+      int err = 0;
+      socklen_t l = sizeof(err);
+      if ((att[i] < 0) || !FD_ISSET(att[i], &wr_set)) continue;
+      getsockopt(att[i], SOL_SOCKET, SO_ERROR, &err, &l);
+      if (!err) {
+        sd = att[i];
+      } else {
+        DBG("[!] connect to address %d failed: %s\n", i, strerror(err));
+        close(att[i]);
+        att[i] = -1;
+        // do not wait for the delay after a failure
+        delay.tv_usec = 0;
+      }
+      running--;
+    }
+  }
+  // cancel the slower attempts
+  for (i = 0; i < started; i++)
+    if ((att[i] >= 0) && (att[i] != sd)) close(att[i]);
+  if (sd >= 0) fcntl(sd, F_SETFL, 0);
+  backend_probed(be, sd >= 0);
+  return sd;
+}
+
+/// Choose the server of a new connection, with the -b algorithm, among the
+/// usable ones. When all servers are down they are all candidates.
+/// @param ls    listener with servers.
+/// @param from  client address.
+/// @param froml size of @a from.
+/// @param tried servers already tried for this connection, skipped.
+/// @return server, or NULL if all were tried.
+struct backend_s *backend_pick(struct listener_s *ls, struct sockaddr *from, socklen_t froml,
+                               const char *tried) {
+  int pass, i, n = ls->nbackends;
+  for (pass = 0; pass < 2; pass++) {
+    struct backend_s *best = NULL;
+    // second pass ignores health
+#define CANDIDATE(k) (!tried[k] && (pass || backend_usable(&ls->backends[k])))
+    switch (balance) {
+      case ROUNDROBIN:
+        for (i = 0; i < n; i++) {
+          int k = (ls->rr + i) % n;
+          if (CANDIDATE(k)) {
+            ls->rr = k+1;
+            return &ls->backends[k];
+          }
+        }
+        break;
+      case LEASTCONN:
+        // ties are rotated, so that idle servers share the load
+        for (i = 0; i < n; i++) {
+          int k = (ls->rr + i) % n;
+          if (CANDIDATE(k) && (!best || (ls->backends[k].conns < best->conns)))
+            best = &ls->backends[k];
+        }
+        if (best) {
+          ls->rr = best - ls->backends + 1;
+          return best;
+        }
+        break;
+      case SOURCEHASH: {
+        uint32_t h = 2166136261u;
+        int lo = 0, hi = n*BACKEND_POINTS;
+        // the client port changes for each connection: address only
+        if (from->sa_family == AF_INET)
+          h = fnv1a(&((struct sockaddr_in *)from)->sin_addr, sizeof(struct in_addr), h);
+        else if (from->sa_family == AF_INET6)
+          h = fnv1a(&((struct sockaddr_in6 *)from)->sin6_addr, sizeof(struct in6_addr), h);
+        else
+          h = fnv1a(from, froml, h);
+        if (!ls->ring) {
+          if (CANDIDATE(0)) return &ls->backends[0];
+          break;
+        }
+        // first point at or after h, then walk the ring to the next candidate
+        while (lo < hi) {
+          int mid = (lo + hi) / 2;
+          if (ls->ring[mid].h < h) lo = mid + 1;
+          else hi = mid;
+        }
+        for (i = 0; i < n*BACKEND_POINTS; i++) {
+          int k = ls->ring[(lo + i) % (n*BACKEND_POINTS)].be;
+          if (CANDIDATE(k)) return &ls->backends[k];
+        }
+        break;
+      }
+    }
+#undef CANDIDATE
+  }
+  return NULL;
+}
+
+/// Start a round of health probes: a non-blocking tcp connect() to each
+/// server. A probe still running at the next round means the server is down.
+/// Without rport the port is not known and only connections detect failures.
+/// @param ls tcp listener with servers.
+void probe_start(struct listener_s *ls) {
+  int i;
+  for (i = 0; i < ls->nbackends; i++) {
+    struct backend_s *be = &ls->backends[i];
+    struct sockaddr_storage s;
+    if (be->probe >= 0) {
+      close(be->probe);
+      be->probe = -1;
+      backend_probed(be, 0);
+    }
+    if (!ls->fixedport && (be->addr[0].ss_family != AF_UNIX)) continue;
+    memcpy(&s, &be->addr[0], be->addrl[0]);
+    if ((be->probe = socket(s.ss_family, SOCK_STREAM, 0)) < 0) continue;
+    fcntl(be->probe, F_SETFL, O_NONBLOCK);
+    if (!connect(be->probe, (struct sockaddr *) &s, be->addrl[0]) || (errno == EINPROGRESS))
+      continue;
+    close(be->probe);
+    be->probe = -1;
+    backend_probed(be, 0);
+  }
+  ls->next_probe = now + probeint;
+}
+
+/// Add the running health probes of a listener to the select() write set.
+/// @param ls   tcp listener with servers.
+/// @param wr   write set.
+/// @param nfds highest socket, updated.
+void probe_fdset(struct listener_s *ls, fd_set *wr, int *nfds) {
+  int i;
+  for (i = 0; i < ls->nbackends; i++) {
+    int sd = ls->backends[i].probe;
+    if (sd < 0) continue;
+    FD_SET(sd, wr);
+    if (*nfds < sd) *nfds = sd;
+  }
+}
+
+/// Collect the finished health probes of a listener.
+/// @param ls tcp listener with servers.
+/// @param wr write set returned by select().
+void probe_check(struct listener_s *ls, fd_set *wr) {
+  int i;
+  for (i = 0; i < ls->nbackends; i++) {
+    struct backend_s *be = &ls->backends[i];
+    int err = 0;
+    socklen_t l = sizeof(err);
+    if ((be->probe < 0) || !FD_ISSET(be->probe, wr)) continue;
+    getsockopt(be->probe, SOL_SOCKET, SO_ERROR, &err, &l);
+    DBG("[*] probe of %s: %s\n", be->host, err ? strerror(err) : "ok");
+    close(be->probe);
+    be->probe = -1;
+    backend_probed(be, !err);
+  }
+}
+
+/// Set the DNS server of the -D option.
+/// @param spec ip or ip,port, 0 for the first nameserver of /etc/resolv.conf.
+void dns_server(const char *spec) {
+  char host[100], *port = "53";
+  struct addrinfo hints, *res;
+
+  if (!strcmp(spec, "0")) {
+    char line[200];
+    FILE *f = fopen("/etc/resolv.conf", "r");
+    host[0] = 0;
+    while (f && !host[0] && fgets(line, sizeof(line), f))
+      if (sscanf(line, " nameserver %99s", host) != 1) host[0] = 0;
+    if (f) fclose(f);
+    if (!host[0]) usage_hints("no nameserver in /etc/resolv.conf");
+  } else {
+    snprintf(host, sizeof(host), "%s", spec);
+    if ((port = strchr(host, ','))) *port++ = 0;
+    else port = "53";
+  }
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = AI_NUMERICHOST;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &res)) usage_hints("invalid DNS server");
+  memcpy(&dnsserver, res->ai_addr, res->ai_addrlen);
+  dnsserverl = res->ai_addrlen;
+  freeaddrinfo(res);
+}
+
+/// Build a DNS query.
+/// @param q     buffer, 512 bytes.
+/// @param id    query id.
+/// @param name  host name.
+/// @param qtype 1 (A) or 28 (AAAA).
+/// @return size of the query, 0 if @a name cannot be queried.
+size_t dns_build(unsigned char *q, uint16_t id, const char *name, int qtype) {
+  size_t l = 12;
+  memset(q, 0, 12);
+  q[0] = id >> 8;
+  q[1] = id;
+  q[2] = 1;                     // recursion desired
+  q[5] = 1;                     // one question
+  while (*name) {
+    size_t n = strcspn(name, ".");
+    if ((n == 0) || (n > 63) || (l + n + 6 > 512)) return 0;
+    q[l++] = n;
+    memcpy(q + l, name, n);
+    l += n;
+    name += n;
+    if (*name) name++;
+  }
+  q[l++] = 0;
+  q[l++] = 0;
+  q[l++] = qtype;
+  q[l++] = 0;
+  q[l++] = 1;                   // class IN
+  return l;
+}
+
+/// Skip a name in a DNS message.
+/// @param m   message.
+/// @param len size of @a m.
+/// @param pos offset of the name.
+/// @return offset after the name, or 0 if @a m is truncated.
+size_t dns_skipname(const unsigned char *m, size_t len, size_t pos) {
+  while (pos < len) {
+    if (m[pos] == 0) return pos + 1;
+    if ((m[pos] & 0xc0) == 0xc0) return (pos + 2 <= len) ? pos + 2 : 0;
+    pos += m[pos] + 1;
+  }
+  return 0;
+}
+
+/// Start resolving a server again: send its A and AAAA queries. When the
+/// previous queries are still running they timed out, the server keeps its
+/// addresses and is resolved again after #DNS_RETRY seconds.
+/// @param be server with a name.
+void dns_query(struct backend_s *be) {
+  unsigned char q[512];
+  size_t l = 1;
+
+  if (be->dns >= 0) {
+    printf("[!] DNS resolution of %s timed out, keeping its addresses.\n", be->host);
+    close(be->dns);
+    be->dns = -1;
+    be->refresh = now + DNS_RETRY;
+    return;
+  }
+  be->qid = rand();
+  be->replied = 0;
+  be->nraddr = 0;
+  be->rttl = DNS_MAXTTL;
+  be->refresh = now + DNS_TIMEOUT;
+  if ((be->dns = socket(dnsserver.ss_family, SOCK_DGRAM, 0)) < 0) {
+    be->refresh = now + DNS_RETRY;
+    return;
+  }
+  fcntl(be->dns, F_SETFL, O_NONBLOCK);
+  if (connect(be->dns, (struct sockaddr *)&dnsserver, dnsserverl)
+      || !(l = dns_build(q, be->qid, be->host, 1)) || (send(be->dns, q, l, 0) < 0)
+      || !(l = dns_build(q, be->qid + 1, be->host, 28)) || (send(be->dns, q, l, 0) < 0)) {
+    printf("[!] Cannot resolve %s: %s.\n", be->host, l ? strerror(errno) : "invalid name");
+    close(be->dns);
+    be->dns = -1;
+    be->refresh = l ? now + DNS_RETRY : 0;
+  }
+}
+
+/// Read a DNS reply of a server. Once both queries are answered the new
+/// addresses replace the previous ones, which are kept if there are none,
+/// and the next resolution is scheduled when the smallest TTL expires.
+/// @param ls listener of the server, for the port.
+/// @param be server with running queries.
+void dns_reply(struct listener_s *ls, struct backend_s *be) {
+  unsigned char m[1500];
+  ssize_t len = recv(be->dns, m, sizeof(m), 0);
+  size_t pos;
+  int q, an, i, same;
+
+  if (len < 12) return;
+  // ids of the A and AAAA queries are qid and qid+1, modulo 2^16
+  q = (uint16_t)(((m[0] << 8) | m[1]) - be->qid);
+  // answers to our queries only
+  if ((q > 1) || (be->replied & (1 << q)) || !(m[2] & 0x80)) return;
+  be->replied |= 1 << q;
+  an = (m[6] << 8) | m[7];
+  pos = dns_skipname(m, len, 12);
+  if ((m[3] & 0x0f) || ((m[4] << 8) | m[5]) != 1 || !pos) an = 0;
+  pos += 4;
+  // all A and AAAA records, the CNAMEs leading to them are skipped
+  while (an-- > 0) {
+    size_t rdlen;
+    int type, af = 0;
+    uint32_t ttl;
+    if (!(pos = dns_skipname(m, len, pos)) || (pos + 10 > (size_t)len)) break;
+    type = (m[pos] << 8) | m[pos+1];
+    ttl = ((uint32_t)m[pos+4] << 24) | (m[pos+5] << 16) | (m[pos+6] << 8) | m[pos+7];
+    rdlen = (m[pos+8] << 8) | m[pos+9];
+    pos += 10;
+    if (pos + rdlen > (size_t)len) break;
+    if ((type == 1) && (rdlen == 4)) af = AF_INET;
+    if ((type == 28) && (rdlen == 16)) af = AF_INET6;
+    if (af) {
+      struct sockaddr_storage *a;
+      be->raddr = realloc(be->raddr, (be->nraddr+1)*sizeof(*be->raddr));
+      be->raddrl = realloc(be->raddrl, (be->nraddr+1)*sizeof(*be->raddrl));
+      if (!be->raddr || !be->raddrl) error("netsed: unable to malloc() server addresses");
+      a = &be->raddr[be->nraddr];
+      memset(a, 0, sizeof(*a));
+      a->ss_family = af;
+      if (af == AF_INET) {
+        memcpy(&((struct sockaddr_in *)a)->sin_addr, m + pos, 4);
+        be->raddrl[be->nraddr] = sizeof(struct sockaddr_in);
+      } else {
+        memcpy(&((struct sockaddr_in6 *)a)->sin6_addr, m + pos, 16);
+        be->raddrl[be->nraddr] = sizeof(struct sockaddr_in6);
+      }
+      set_port((struct sockaddr *)a, ls->fixedport);
+      be->nraddr++;
+      if (ttl < be->rttl) be->rttl = ttl;
+    }
+    pos += rdlen;
+  }
+  if (be->replied != 3) return;
+
+  close(be->dns);
+  be->dns = -1;
+  if (!be->nraddr) {
+    printf("[!] DNS resolution of %s failed, keeping its addresses.\n", be->host);
+    be->refresh = now + DNS_RETRY;
+    return;
+  }
+  addr_interleave(be->raddr, be->raddrl, be->nraddr);
+  same = (be->nraddr == be->naddr);
+  for (i = 0; same && (i < be->naddr); i++)
+    same = (be->raddrl[i] == be->addrl[i]) && !memcmp(&be->raddr[i], &be->addr[i], be->addrl[i]);
+  if (!same) {
+    struct sockaddr_storage *a = be->addr;
+    socklen_t *al = be->addrl;
+    printf("[+] Server %s now resolves to %s%s.\n", be->host,
+           addr_str((struct sockaddr *)&be->raddr[0], be->raddrl[0]),
+           (be->nraddr > 1) ? " and more" : "");
+    // swap, the previous arrays receive the next resolution
+    be->addr = be->raddr;
+    be->addrl = be->raddrl;
+    be->naddr = be->nraddr;
+    be->raddr = a;
+    be->raddrl = al;
+  }
+  be->refresh = now + (be->rttl ? be->rttl : 1);
+  DBG("[*] %s resolved again in %u seconds\n", be->host, be->rttl);
+}
+
+/// Resolve the server names of a listener when due, and add the running
+/// DNS queries to the select() read set.
+/// @param ls   listener with servers.
+/// @param rd   read set.
+/// @param nfds highest socket, updated.
+/// @return time of the next resolution or query timeout, 0 if none.
+time_t dns_fdset(struct listener_s *ls, fd_set *rd, int *nfds) {
+  int i;
+  time_t next = 0;
+  for (i = 0; i < ls->nbackends; i++) {
+    struct backend_s *be = &ls->backends[i];
+    if (!be->refresh) continue;
+    if (now >= be->refresh) dns_query(be);
+    if (be->dns >= 0) {
+      FD_SET(be->dns, rd);
+      if (*nfds < be->dns) *nfds = be->dns;
+    }
+    if (be->refresh && (!next || (be->refresh < next))) next = be->refresh;
+  }
+  return next;
+}
+
+/// Read the DNS replies of the servers of a listener.
+/// @param ls listener with servers.
+/// @param rd read set returned by select().
+void dns_check(struct listener_s *ls, fd_set *rd) {
+  int i;
+  for (i = 0; i < ls->nbackends; i++) {
+    struct backend_s *be = &ls->backends[i];
+    if ((be->dns >= 0) && FD_ISSET(be->dns, rd)) dns_reply(ls, be);
+  }
+}
+
+/// Handle activity on a listening socket: accept a tcp connection, or
+/// receive an udp datagram and find or create its pseudo-connection.
+/// @param ls listener with a readable socket.
+/// @return 1 if there may be more connections to accept, 0 otherwise.
+int accept_connection(struct listener_s *ls) {
+  struct sockaddr_storage s, from, odst;
+  socklen_t l = sizeof(s), froml, odl = 0;
+  in_port_t conpo;
+  struct tracker_s * conn = NULL;
+  int csock=-1;
+  ssize_t rd=-1;
+
+  if (ls->tcp) {
+    // the connection socket stays blocking, like the forwarding one
+#ifdef SOCK_CLOEXEC
+    csock = accept4(ls->lsock,(struct sockaddr*)&s,&l,SOCK_CLOEXEC);
+#else
+    csock = accept(ls->lsock,(struct sockaddr*)&s,&l);
+    if (csock >= 0) fcntl(csock, F_SETFL, 0);
+#endif
+    if (csock < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        DBG("[!] accept(): %s\n", strerror(errno));
+      return 0;
+    }
+  } else {
+    // udp does not handle accept, so track connections manually
+    // also set csock if a new connection need to be registered
+    // to share the code with tcp ;)
+    rd = recv_datagram(ls->lsock, &s, &l, &odst, &odl);
+    if(rd >= 0) {
+      conn = connections;
+      while(conn != NULL) {
+        // look for existing connections
+        if ((conn->ls == ls) && (conn->csl == l) && (0 == memcmp(&s, conn->csa, l))) {
+          // found
+          break;
+        }
+        // point on next
+        conn = conn->n;
+      }
+      // not found
+      if(conn == NULL) {
+        // udp 'connection' socket is the listening one
+        csock = ls->lsock;
+      } else {
+        DBG("[+] Got incoming datagram from existing connection.\n");
+      }
+    } else {
+      ERR("recvfrom(): %s", strerror(errno));
+    }
+  }
+
+  // new connection (tcp accept, or udp conn not found)
+  if ((csock)>=0) {
+    int one=1;
+    printf("[+] Got incoming connection from %s", addr_str((struct sockaddr *) &s, l));
+    conn = malloc(sizeof(struct tracker_s));
+    if(NULL == conn) error("netsed: unable to malloc() connection tracker struct");
+    // protocol specific init
+    if (ls->tcp) {
+      setsockopt(csock,SOL_SOCKET,SO_OOBINLINE,&one,sizeof(int));
+      conn->csa = NULL;
+      conn->csl = 0;
+      conn->state = ESTABLISHED;
+    } else {
+      conn->csa = malloc(l);
+      if(NULL == conn->csa) error("netsed: unable to malloc() connection tracker sockaddr struct");
+      memcpy(conn->csa, &s, l);
+      conn->csl = l;
+      conn->state = UNREPLIED;
+    }
+    conn->csock = csock;
+    conn->time = now;
+    conn->ls = ls;
+
+    conn->rs = NULL;
+    conn->live = NULL;
+    conn->pos[C2S] = conn->pos[S2C] = 0;
+    conn->eof[C2S] = conn->eof[S2C] = 0;
+    rebind_ruleset(conn);
+
+    memcpy(&from, &s, l);
+    froml = l;
+    l = sizeof(s);
+    if (from.ss_family == AF_UNIX) {
+      // forwarding is fixed, just report the listener
+      getsockname(csock,(struct sockaddr*)&s,&l);
+    } else if (tproxy) {
+      // TPROXY: the original destination is the local address
+      if (ls->tcp) {
+        getsockname(csock,(struct sockaddr*)&s,&l);
+      } else {
+        memcpy(&s, &odst, odl);
+        l = odl;
+      }
+    } else {
+#ifndef LINUX_NETFILTER
+      // was OK for linux 2.2 nat
+      getsockname(csock,(struct sockaddr*)&s,&l);
+#else
+      // for linux 2.4 and later
+      getsockopt(csock, SOL_IP, SO_ORIGINAL_DST,(struct sockaddr*)&s,&l);
+#endif
+    }
+    printf(" to %s\n", addr_str((struct sockaddr *) &s, l));
+    conpo = get_port((struct sockaddr *) &s);
+
+    if (tproxy && !ls->tcp && odl) {
+      // reply from the original destination, the client expects it
+      int sd = socket(s.ss_family, SOCK_DGRAM, 0);
+      if ((sd >= 0) && !set_transparent(sd, s.ss_family)
+          && !setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+          && !bind(sd, (struct sockaddr*)&s, l)
+          && !connect(sd, (struct sockaddr*)&from, froml)) {
+        // later datagrams of the client are received on it
+        conn->csock = sd;
+      } else {
+        printf("[!] Cannot reply from original destination: %s.\n", strerror(errno));
+        if (sd >= 0) close(sd);
+      }
+    }
+
+    if (ls->fixedport) conpo=ls->fixedport;
+    conn->fsock = -1;
+    conn->be = NULL;
+
+    if (!ls->nbackends) {
+      // forward to the original destination
+      set_port((struct sockaddr *) &s, conpo);
+      printf("[*] Forwarding connection to %s\n", addr_str((struct sockaddr *) &s, l));
+      conn->fsock = forward_connect(ls, (struct sockaddr*)&s, l, (struct sockaddr*)&from, froml);
+    } else if ((conn->fsock = pool_take(ls)) >= 0) {
+      conn->be = &ls->backends[0];
+      printf("[*] Forwarding connection to %s\n",
+             addr_str((struct sockaddr *) &conn->be->addr[0], conn->be->addrl[0]));
+      printf("[*] Using pre-connected connection.\n");
+    } else {
+      char tried[ls->nbackends];
+      memset(tried, 0, sizeof(tried));
+      // fail over to the next server until one accepts
+      while ((conn->fsock < 0)
+             && (conn->be = backend_pick(ls, (struct sockaddr*)&from, froml, tried))) {
+        tried[conn->be - ls->backends] = 1;
+        conn->fsock = backend_connect(ls, conn->be, conpo, (struct sockaddr*)&from, froml);
+      }
+    }
+
+    if (conn->fsock < 0) {
+       printf("[!] Cannot connect to remote server, dropping connection.\n");
+       conn->be = NULL;
+       freetracker(conn);
+       conn = NULL;
+    } else {
+      stats.conns++;
+      if (conn->be) conn->be->conns++;
+      setsockopt(conn->fsock,SOL_SOCKET,SO_OOBINLINE,&one,sizeof(int));
+      if (ls->tcp && (keepalive[0] || usertimeout)) {
+        set_keepalive(conn->csock);
+        set_keepalive(conn->fsock);
+      }
+      conn->n = connections;
+      connections = conn;
+    }
+  }
+  // udp has data process forwarding
+  if((rd >= 0) && (conn != NULL)) {
+    b2server_sed(conn, rd);
+  }
+  return ls->tcp;
+}
+
 /// This is main...
 int main(int argc,char* argv[]) {
-  int i, ret;
-  in_port_t fixedport = 0;
-  struct sockaddr_storage fixedhost;
-  struct addrinfo hints, *res, *reslist;
-  int tcp;
+  int i;
+  const char *rulefile = NULL, *config = NULL;
+  struct rulesrc_s *src;
+  struct listener_s *ls;
   struct tracker_s * conn;
 
 #ifdef DAEMON_MODE
   daemon(0, 0);
 #endif
 
-  memset(&fixedhost, '\0', sizeof(fixedhost));
   printf("netsed " VERSION " by Julien VdG <julien@silicone.homelinux.org>\n"
          "      based on 0.01c from Michal Zalewski <lcamtuf@ids.pl>\n");
   setbuffer(stdout,NULL,0);
-  if (argc<6) usage_hints("not enough parameters");
-  if (strcasecmp(argv[1],"tcp")*strcasecmp(argv[1],"udp")) usage_hints("incorrect protocol");
-  tcp = strncasecmp(argv[1], "udp", 3);
-  // allocate rule arrays, rule number is number of params after 5
-  rule=calloc(1, (argc-5)*sizeof(struct rule_s));
-  rule_live=calloc(1, (argc-5)*sizeof(int));
-  // parse rules
-  for (i=5;i<argc;i++) {
-    char *fs=0, *ts=0, *cs=0;
-    printf("[*] Parsing rule %s...\n",argv[i]);
-    fs=strchr(argv[i],'/');
-    if (!fs) error("missing first '/' in rule");
-    fs++;
-    ts=strchr(fs,'/');
-    if (!ts) error("missing second '/' in rule");
-    *ts=0;
-    ts++;
-    cs=strchr(ts,'/');
-    if (cs) { *cs=0; cs++; }
-    rule[rules].forig=fs;
-    rule[rules].torig=ts;
-    if (cs && *cs) /* Only non-trivial quantifiers count. */
-      rule_live[rules]=atoi(cs); else rule_live[rules]=-1;
-    shrink_to_binary(&rule[rules]);
-//    printf("DEBUG: (%s) (%s)\n",rule[rules].from,rule[rules].to);
-    rules++;
-  }
-
-  printf("[+] Loaded %d rule%s...\n", rules, (rules > 1) ? "s" : "");
-
-  memset(&hints, '\0', sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_flags = AI_CANONNAME;
-  hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
-
-  if ((ret = getaddrinfo(argv[3], argv[4], &hints, &reslist))) {
-    ERR("getaddrinfo(): %s\n", gai_strerror(ret));
-    error("Impossible to resolve remote address or port.");
+  // '+': stop at proto, rules could look like options
+  while ((i = getopt(argc, argv, "+f:c:tsp:b:H:D:l:A:F:i:k:u:j:m:")) != -1) {
+    switch (i) {
+      case 't':
+#ifndef TPROXY
+        usage_hints("TPROXY is not supported on this system");
+#endif
+        tproxy = 1;
+        break;
+      case 's':
+        keepsrc = 1;
+        break;
+      case 'f':
+        rulefile = optarg;
+        break;
+      case 'c':
+        config = optarg;
+        break;
+      case 'p':
+        poolsz = atoi(optarg);
+        if (poolsz < 0) usage_hints("invalid pool size");
+        break;
+      case 'b':
+        for (balance = ROUNDROBIN; balance <= SOURCEHASH; balance++)
+          if (!strcmp(optarg, balance_name[balance])) break;
+        if (balance > SOURCEHASH) usage_hints("unknown balancing algorithm");
+        break;
+      case 'H':
+        probeint = atoi(optarg);
+        if (probeint < 0) usage_hints("invalid probe interval");
+        break;
+      case 'D':
+        dns_server(optarg);
+        break;
+      case 'l':
+        backlog = atoi(optarg);
+        if (backlog <= 0) usage_hints("invalid backlog");
+        break;
+      case 'A':
+        deferaccept = atoi(optarg);
+        if (deferaccept < 0) usage_hints("invalid defer accept delay");
+        break;
+      case 'F':
+        fastopen = atoi(optarg);
+        if (fastopen < 0) usage_hints("invalid fast open queue");
+        break;
+      case 'i':
+        idletimeout = atoi(optarg);
+        if (idletimeout < 0) usage_hints("invalid idle timeout");
+        break;
+      case 'k':
+        if ((sscanf(optarg, "%d,%d,%d", &keepalive[0], &keepalive[1], &keepalive[2]) < 1)
+            || (keepalive[0] <= 0) || (keepalive[1] < 0) || (keepalive[2] < 0))
+          usage_hints("invalid keepalive");
+        break;
+      case 'u':
+        usertimeout = atoi(optarg);
+        if (usertimeout < 0) usage_hints("invalid user timeout");
+        break;
+      case 'j':
+        if ((sscanf(optarg, "%d,%d", &scanthreads, &scanmin) < 1)
+            || (scanthreads < 0) || (scanmin < 1))
+          usage_hints("invalid scan threads");
+        break;
+      case 'm':
+        if (!strcmp(optarg, "first")) matchmode = MATCH_FIRST;
+        else if (!strcmp(optarg, "longest")) matchmode = MATCH_LONGEST;
+        else usage_hints("invalid match mode");
+        break;
+      default:
+        usage_hints("unknown option");
+    }
   }
-  /* We have candidates for remote host. */
-  for (res = reslist; res; res = res->ai_next) {
-    int sd = -1;
+  // shift options, so that argv[1] is proto
+  argc -= optind-1;
+  argv += optind-1;
+  if ((argc>1) && !strcmp(argv[1], "compile")) compile_rules(argc, argv);
+  if ((argc>1) && !strcmp(argv[1], "bench")) bench_kernels(argc, argv);
+  // the command line listener is optional with a configuration file
+  if ((config ? (argc>1) && (argc<5) : (argc<(rulefile ? 5 : 6))))
+    usage_hints("not enough parameters");
+  // rules are the params after 5
+  src = rulesrc_get(rulefile, (argc>5) ? &argv[5] : NULL, (argc>5) ? argc-5 : 0);
+  if (argc>1) listener_add(&argv[1], src);
+  if (config) config_load(config, src);
+  if (!listeners) usage_hints("no listener in configuration file");
 
-    if ( (sd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
-      continue;
-    /* Has successfully built a socket for this address family. */
-    /* Record the address structure and the port. */
-    fixedport = get_port(res->ai_addr);
-    if (!is_addr_any(res->ai_addr))
-      memcpy(&fixedhost, res->ai_addr, res->ai_addrlen);
-    close(sd);
-    break;
+  for (src = rulesrcs; src != NULL; src = src->n) {
+    const char *err;
+    src->rs = ruleset_load(src->file, src->args, src->nargs, &err);
+    if (!src->rs) error(err);
+    printf("[+] Loaded %d rule%s...\n", src->rs->rules, (src->rs->rules > 1) ? "s" : "");
   }
-  freeaddrinfo(reslist);
-  if (res == NULL)
-    error("Failed in resolving remote host.");
-
-  if (fixedhost.ss_family && fixedport)
-    printf("[+] Using fixed forwarding to %s,%s.\n",argv[3],argv[4]);
-  else if (fixedport)
-    printf("[+] Using dynamic (transparent proxy) forwarding with fixed port %s.\n",argv[4]);
-  else if (fixedhost.ss_family)
-    printf("[+] Using dynamic (transparent proxy) forwarding with fixed addr %s.\n",argv[3]);
-  else
-    printf("[+] Using dynamic (transparent proxy) forwarding.\n");
-
-  bind_and_listen(fixedhost.ss_family, tcp, argv[2]);
-
-  printf("[+] Listening on port %s/%s.\n", argv[2], argv[1]);
 
   signal(SIGPIPE, SIG_IGN);
   struct sigaction sa;
+  sigset_t sigmask, selmask;
   sa.sa_flags = 0;
   sigemptyset(&sa.sa_mask);
   sa.sa_handler = sig_int;
   if (sigaction(SIGINT, &sa, NULL) == -1) error("netsed: sigaction() failed");
+  sa.sa_handler = sig_hup;
+  if (sigaction(SIGHUP, &sa, NULL) == -1) error("netsed: sigaction() failed");
+  sa.sa_handler = sig_usr1;
+  if (sigaction(SIGUSR1, &sa, NULL) == -1) error("netsed: sigaction() failed");
+  // signals are only delivered while waiting in pselect(), so that the
+  // flags they set are never missed between their check and the wait.
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGINT);
+  sigaddset(&sigmask, SIGHUP);
+  sigaddset(&sigmask, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &sigmask, &selmask);
+  // after blocking signals, which the threads inherit
+  scanpool_start();
 
-  while (!stop) {
-    struct sockaddr_storage s;
-    socklen_t l = sizeof(s);
-    struct sockaddr_storage conho;
-    in_port_t conpo;
-    char ipstr[INET6_ADDRSTRLEN], portstr[12];
+  time(&now);
+  srand(now ^ getpid());
+  // signals are ready once listening is reported
+  for (ls = listeners; ls != NULL; ls = ls->n)
+    printf("[+] Listening on port %s/%s.\n", ls->spec[1], ls->spec[0]);
 
+  while (!stop) {
     int sel;
-    fd_set rd_set;
-    struct timeval timeout, *ptimeout;
-    int nfds = lsock;
+    fd_set rd_set, wr_set;
+    struct timespec timeout, *ptimeout;
+    int nfds = 0;
     FD_ZERO(&rd_set);
-    FD_SET(lsock,&rd_set);
+    FD_ZERO(&wr_set);
     timeout.tv_sec = UDP_TIMEOUT+1;
-    timeout.tv_usec = 0;
+    timeout.tv_nsec = 0;
     ptimeout = NULL;
+    for (ls = listeners; ls != NULL; ls = ls->n) {
+      FD_SET(ls->lsock,&rd_set);
+      if (nfds < ls->lsock) nfds = ls->lsock;
+      if (ls->pool) {
+        pool_fill(ls);
+        pool_fdset(ls, &rd_set, &wr_set, &nfds);
+        // refill failed: try again later
+        if (ls->pool_retry > now) {
+          timeout.tv_sec = 1;
+          ptimeout = &timeout;
+        }
+      }
+      if (dnsserverl && ls->nbackends) {
+        time_t next = dns_fdset(ls, &rd_set, &nfds);
+        if (next) {
+          if (timeout.tv_sec > next - now) timeout.tv_sec = next - now;
+          ptimeout = &timeout;
+        }
+      }
+      if (probeint && ls->nbackends && ls->tcp) {
+        if (now >= ls->next_probe) probe_start(ls);
+        probe_fdset(ls, &wr_set, &nfds);
+        if (timeout.tv_sec > ls->next_probe - now) timeout.tv_sec = ls->next_probe - now;
+        ptimeout = &timeout;
+      }
+    }
 
     {
       conn = connections;
       while(conn != NULL) {
-        if(tcp) {
+        if((conn->csock != conn->ls->lsock) && !conn->eof[C2S]) {
           FD_SET(conn->csock, &rd_set);
           if (nfds < conn->csock) nfds = conn->csock;
-        } else {
+        }
+        if(!conn->ls->tcp || idletimeout) {
           // adjust timeout to earliest connection end time
-          int remain = UDP_TIMEOUT - (now - conn->time);
+          int remain = (conn->ls->tcp ? idletimeout : UDP_TIMEOUT) - (now - conn->time);
           if (remain < 0) remain = 0;
-          if (timeout.tv_sec > remain) {
+          if (!ptimeout || (timeout.tv_sec > remain)) {
             timeout.tv_sec = remain;
             // time updated to need to timeout
             ptimeout = &timeout;
           }
         }
-        FD_SET(conn->fsock, &rd_set);
-        if (nfds < conn->fsock) nfds = conn->fsock;
+        if(!conn->eof[S2C]) {
+          FD_SET(conn->fsock, &rd_set);
+          if (nfds < conn->fsock) nfds = conn->fsock;
+        }
         // point on next
         conn = conn->n;
       }
     }
 
-    sel=select(nfds+1, &rd_set, (fd_set*)0, (fd_set*)0, ptimeout);
+    sel=pselect(nfds+1, &rd_set, &wr_set, (fd_set*)0, ptimeout, &selmask);
     time(&now);
     if (stop)
     {
       break;
     }
+    if (reload) {
+      reload = 0;
+      reload_rules();
+    }
+    if (dump) {
+      dump = 0;
+      print_stats();
+    }
+    if ((sel < 0) && (errno == EINTR)) continue;
     if (sel < 0) {
       DBG("[!] select fail! %s\n", strerror(errno));
       break;
@@ -728,129 +4356,39 @@ int main(int argc,char* argv[]) {
       // For tcp, select will not timeout.
     }
 
-    if (FD_ISSET(lsock, &rd_set)) {
-      int csock=-1;
-      ssize_t rd=-1;
-      if (tcp) {
-        csock = accept(lsock,(struct sockaddr*)&s,&l);
-      } else {
-        // udp does not handle accept, so track connections manually
-        // also set csock if a new connection need to be registered
-        // to share the code with tcp ;)
-        rd = recvfrom(lsock,buf,sizeof(buf),0,(struct sockaddr*)&s,&l);
-        if(rd >= 0) {
-          conn = connections;
-          while(conn != NULL) {
-            // look for existing connections
-            if ((conn->csl == l) && (0 == memcmp(&s, conn->csa, l))) {
-              // found
-              break;
-            }
-            // point on next
-            conn = conn->n;
-          }
-          // not found
-          if(conn == NULL) {
-            // udp 'connection' socket is the listening one
-            csock = lsock;
-          } else {
-            DBG("[+] Got incoming datagram from existing connection.\n");
-          }
-        } else {
-          ERR("recvfrom(): %s", strerror(errno));
-        }
-      }
-
-      // new connection (tcp accept, or udp conn not found)
-      if ((csock)>=0) {
-        int one=1;
-        getnameinfo((struct sockaddr *) &s, l, ipstr, sizeof(ipstr),
-                    portstr, sizeof(portstr), NI_NUMERICHOST | NI_NUMERICSERV);
-        printf("[+] Got incoming connection from %s,%s", ipstr, portstr);
-        conn = malloc(sizeof(struct tracker_s));
-        if(NULL == conn) error("netsed: unable to malloc() connection tracker struct");
-        // protocol specific init
-        if (tcp) {
-          setsockopt(csock,SOL_SOCKET,SO_OOBINLINE,&one,sizeof(int));
-          conn->csa = NULL;
-          conn->csl = 0;
-          conn->state = ESTABLISHED;
-        } else {
-          conn->csa = malloc(l);
-          if(NULL == conn->csa) error("netsed: unable to malloc() connection tracker sockaddr struct");
-          memcpy(conn->csa, &s, l);
-          conn->csl = l;
-          conn->state = UNREPLIED;
-        }
-        conn->csock = csock;
-        conn->time = now;
-
-        conn->live = malloc(rules*sizeof(int));
-        if(NULL == conn->live) error("netsed: unable to malloc() connection tracker sockaddr struct");
-        memcpy(conn->live, rule_live, rules*sizeof(int));
-
-        l = sizeof(s);
-#ifndef LINUX_NETFILTER
-        // was OK for linux 2.2 nat
-        getsockname(csock,(struct sockaddr*)&s,&l);
-#else
-        // for linux 2.4 and later
-        getsockopt(csock, SOL_IP, SO_ORIGINAL_DST,(struct sockaddr*)&s,&l);
-#endif
-        getnameinfo((struct sockaddr *) &s, l, ipstr, sizeof(ipstr),
-                    portstr, sizeof(portstr), NI_NUMERICHOST | NI_NUMERICSERV);
-        printf(" to %s,%s\n", ipstr, portstr);
-        conpo = get_port((struct sockaddr *) &s);
-
-        memcpy(&conho, &s, sizeof(conho));
-
-        if (fixedport) conpo=fixedport;
-        if (fixedhost.ss_family)
-          memcpy(&conho, &fixedhost, sizeof(conho));
-
-        // forward to addr
-        memcpy(&s, &conho, sizeof(s));
-        set_port((struct sockaddr *) &s, conpo);
-        getnameinfo((struct sockaddr *) &s, l, ipstr, sizeof(ipstr),
-                    portstr, sizeof(portstr), NI_NUMERICHOST | NI_NUMERICSERV);
-        printf("[*] Forwarding connection to %s,%s\n", ipstr, portstr);
-
-        // connect will bind with some dynamic addr/port
-        conn->fsock = socket(s.ss_family, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
-
-	//bind_forward(conn->fsock, fixedhost.ss_family, tcp, "33333");
-
-        if (connect(conn->fsock,(struct sockaddr*)&s,l)) {
-           printf("[!] Cannot connect to remote server, dropping connection.\n");
-           freetracker(conn);
-           conn = NULL;
-        } else {
-          setsockopt(conn->fsock,SOL_SOCKET,SO_OOBINLINE,&one,sizeof(int));
-          conn->n = connections;
-          connections = conn;
-        }
+    for (ls = listeners; ls != NULL; ls = ls->n) {
+      if (ls->pool) pool_check(ls, &rd_set, &wr_set);
+      if (probeint && ls->nbackends && ls->tcp) probe_check(ls, &wr_set);
+      if (dnsserverl && ls->nbackends) dns_check(ls, &rd_set);
+      if (FD_ISSET(ls->lsock, &rd_set)) {
+        // drain the queue of a burst, but leave time for the other sockets
+        int budget = ACCEPT_BUDGET;
+        while (accept_connection(ls) && --budget);
       }
-      // udp has data process forwarding
-      if((rd >= 0) && (conn != NULL)) {
-        b2server_sed(conn, rd);
-      }
-    } // lsock is set
+    }
     // all other sockets
     conn = connections;
     struct tracker_s ** pconn = &connections;
     while(conn != NULL) {
       // incoming data ?
-      if(tcp && FD_ISSET(conn->csock, &rd_set)) {
+      if((conn->csock != conn->ls->lsock) && FD_ISSET(conn->csock, &rd_set)) {
         client2server_sed(conn);
       }
       if(FD_ISSET(conn->fsock, &rd_set)) {
         server2client_sed(conn);
       }
-      // timeout ? udp only
+      // timeout ? udp, and tcp with -i
       DBG("[!] connection last time: %d, now: %d\n", conn->time, now);
-      if(!tcp && ((now - conn->time) >= UDP_TIMEOUT)) {
-        DBG("[!] connection timeout.\n");
-        conn->state = TIMEOUT;
+      if(conn->state < DISCONNECTED) {
+        if(!conn->ls->tcp && ((now - conn->time) >= UDP_TIMEOUT)) {
+          DBG("[!] connection timeout.\n");
+          conn->state = TIMEOUT;
+          stats.expired++;
+        } else if(conn->ls->tcp && idletimeout && ((now - conn->time) >= idletimeout)) {
+          printf("[!] Closing connection idle for %ld seconds.\n", (long)(now - conn->time));
+          conn->state = TIMEOUT;
+          stats.reaped++;
+        }
       }
       if(conn->state >= DISCONNECTED) {
         // remove it
@@ -865,6 +4403,7 @@ int main(int argc,char* argv[]) {
     }
   }
 
+  print_stats();
   clean_socks();
   exit(0);
 }
@@ -0,0 +1,482 @@
+//  Load generator and echo/sink server for netsed benchmarks.
+//  Used by test/loadtest.sh (make loadtest), see README.
+
+///@file loadgen.c
+///@brief netsed load generator and local echo/sink server.
+///@par Architecture
+/// The same binary has two roles:
+/// - "server": a local echo or sink server standing for the remote host,
+///   one thread per accepted tcp connection, a single recvfrom() loop for udp.
+/// - "client": N worker threads, each one driving a tcp connection or an udp
+///   flow through netsed, either in closed loop (next message once the echo
+///   is back) or at a fixed aggregated rate.
+/// .
+/// At the end the client aggregates the worker counters and prints the
+/// throughput (Gbit/s), message rate (packets/s), connection setup rate and
+/// latency percentiles.
+///
+/// @note With a fixed rate the latency is measured from the time the message
+/// was scheduled, not from the time it was actually sent, so a stalled proxy
+/// is not hidden by the generator waiting for it (coordinated omission).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+/// printf to stderr
+#define ERR(x...) fprintf(stderr,x)
+
+/// Largest message, fits in an udp datagram.
+#define MAX_MSG 65000
+
+/// Server behaviour.
+enum mode_e {
+  /// send back everything received.
+  ECHO,
+  /// drop everything received.
+  SINK
+};
+
+/// Per worker (client thread) counters.
+struct worker_s {
+  /// thread handle.
+  pthread_t th;
+  /// payload bytes sent.
+  uint64_t bytes_out;
+  /// payload bytes received.
+  uint64_t bytes_in;
+  /// messages completed (sent, and echoed back in echo mode).
+  uint64_t msgs;
+  /// connections established.
+  uint64_t conns;
+  /// time spent in connect(), in microseconds.
+  uint64_t conn_us;
+  /// failed connections, short reads and udp losses.
+  uint64_t errors;
+  /// latency samples in microseconds.
+  uint32_t *lat;
+  /// number of samples in #lat.
+  size_t nlat;
+  /// allocated size of #lat.
+  size_t cap;
+};
+
+/// 1 for tcp, 0 for udp.
+int tcp = 1;
+/// Echo or sink.
+enum mode_e mode = ECHO;
+/// Number of concurrent connections (or udp flows).
+int nconns = 1;
+/// Message size.
+int msgsize = 512;
+/// Test duration in seconds.
+int duration = 5;
+/// Aggregated message rate, 0 for closed loop.
+double rate = 0;
+/// Open a new connection for every message.
+int churn = 0;
+/// Resolved destination.
+struct addrinfo *dest;
+/// Deadline of the test (monotonic clock, in microseconds).
+uint64_t deadline;
+
+/// Display usage and exit.
+/// @param why the error message.
+void usage_hints(const char* why) {
+  ERR("Error: %s\n\n",why);
+  ERR("Usage: loadgen server [-u] [-m echo|sink] port\n");
+  ERR("       loadgen client [-u] [-m echo|sink] [-c conns] [-s size] [-d secs]\n");
+  ERR("                      [-r rate] [-C] host port\n\n");
+  ERR("  port (server) or host (client) can be unix:path for a unix socket,\n");
+  ERR("  the client port is then ignored.\n\n");
+  ERR("  -u       - use udp instead of tcp\n");
+  ERR("  -m mode  - echo (default) returns data, sink drops it\n");
+  ERR("  -c conns - concurrent connections or udp flows (default 1)\n");
+  ERR("  -s size  - message size in bytes (default 512)\n");
+  ERR("  -d secs  - test duration (default 5)\n");
+  ERR("  -r rate  - total messages per second (default 0, closed loop)\n");
+  ERR("  -C       - new tcp connection for every message (setup rate)\n");
+  exit(1);
+}
+
+/// Current monotonic time in microseconds.
+uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/// Sleep until the given monotonic time.
+/// @param t wake up time in microseconds.
+void sleep_until(uint64_t t) {
+  struct timespec ts;
+  ts.tv_sec = t/1000000;
+  ts.tv_nsec = (t%1000000)*1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/// Write the whole buffer.
+/// @return 0 on success, -1 on error.
+int write_all(int fd, const char *b, int len) {
+  while (len > 0) {
+    ssize_t wr = write(fd, b, len);
+    if (wr <= 0) {
+      if ((wr < 0) && (errno == EINTR)) continue;
+      return -1;
+    }
+    b += wr; len -= wr;
+  }
+  return 0;
+}
+
+/// Read exactly len bytes.
+/// @return 0 on success, -1 on error or EOF.
+int read_all(int fd, char *b, int len) {
+  while (len > 0) {
+    ssize_t rd = read(fd, b, len);
+    if (rd <= 0) {
+      if ((rd < 0) && (errno == EINTR)) continue;
+      return -1;
+    }
+    b += rd; len -= rd;
+  }
+  return 0;
+}
+
+/// Record a latency sample.
+void add_sample(struct worker_s *w, uint64_t us) {
+  if (w->nlat == w->cap) {
+    w->cap = w->cap ? w->cap*2 : 4096;
+    w->lat = realloc(w->lat, w->cap*sizeof(uint32_t));
+    if (!w->lat) { ERR("loadgen: unable to realloc() samples\n"); exit(2); }
+  }
+  w->lat[w->nlat++] = (us > UINT32_MAX) ? UINT32_MAX : us;
+}
+
+/// Fill a unix socket address from a "unix:path" host or port.
+/// @return 1 if @a spec is a unix socket, else 0.
+int unix_addr(const char *spec, struct sockaddr_un *sun, socklen_t *l) {
+  if (strncmp(spec, "unix:", 5)) return 0;
+  if (strlen(spec+5) >= sizeof(sun->sun_path)) usage_hints("unix socket path too long");
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  strcpy(sun->sun_path, spec+5);
+  *l = offsetof(struct sockaddr_un, sun_path) + strlen(sun->sun_path) + 1;
+  return 1;
+}
+
+/// Open the client socket to #dest and account for the connection time.
+/// @return the socket or -1.
+int open_client(struct worker_s *w) {
+  uint64_t t0 = now_us();
+  int one = 1;
+  int sd = socket(dest->ai_family, dest->ai_socktype, dest->ai_protocol);
+  if (sd < 0) return -1;
+  if ((dest->ai_family == AF_UNIX) && !tcp) {
+    // unix datagrams: autobind an abstract address to get the echo
+    sa_family_t af = AF_UNIX;
+    bind(sd, (struct sockaddr *)&af, sizeof(af));
+  }
+  if (connect(sd, dest->ai_addr, dest->ai_addrlen)) {
+    close(sd);
+    w->errors++;
+    return -1;
+  }
+  if (tcp) {
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  } else {
+    struct timeval tv = { 1, 0 };
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+  w->conn_us += now_us() - t0;
+  w->conns++;
+  return sd;
+}
+
+/// Client worker thread body.
+/// @param arg the struct worker_s to fill.
+void *client_worker(void *arg) {
+  struct worker_s *w = arg;
+  char *out = malloc(msgsize), *in = malloc(msgsize);
+  uint64_t period = rate > 0 ? (uint64_t)(1e6*nconns/rate) : 0;
+  uint64_t next = now_us();
+  int sd = -1;
+
+  if (!out || !in) { ERR("loadgen: unable to malloc() buffers\n"); exit(2); }
+  // payload that matches none of the loadtest rules
+  memset(out, 'x', msgsize);
+  while (next < deadline) {
+    uint64_t t0 = period ? next : now_us();
+    if (sd < 0 && (sd = open_client(w)) < 0) {
+      usleep(1000);
+      next = now_us();
+      continue;
+    }
+    if (tcp) {
+      if (write_all(sd, out, msgsize)) goto broken;
+      w->bytes_out += msgsize;
+      if (mode == ECHO) {
+        if (read_all(sd, in, msgsize)) goto broken;
+        w->bytes_in += msgsize;
+      }
+    } else {
+      if (send(sd, out, msgsize, 0) != msgsize) goto broken;
+      w->bytes_out += msgsize;
+      if (mode == ECHO) {
+        ssize_t rd = recv(sd, in, msgsize, 0);
+        if (rd <= 0) { w->errors++; goto next; }
+        w->bytes_in += rd;
+      }
+    }
+    w->msgs++;
+    if (mode == ECHO) add_sample(w, now_us() - t0);
+    if (churn) { close(sd); sd = -1; }
+next:
+    if (period) {
+      next += period;
+      sleep_until(next);
+    } else {
+      next = now_us();
+    }
+    continue;
+broken:
+    w->errors++;
+    close(sd);
+    sd = -1;
+    next = now_us();
+  }
+  if (sd >= 0) close(sd);
+  free(out);
+  free(in);
+  return NULL;
+}
+
+/// Compare two latency samples for qsort().
+int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+/// Run the client workers and print the report.
+/// @param host destination host (netsed).
+/// @param port destination port.
+int client(const char *host, const char *port) {
+  struct addrinfo hints, unix_dest;
+  struct sockaddr_un sun;
+  struct worker_s *w, total;
+  uint32_t *all;
+  uint64_t start, elapsed;
+  double secs;
+  int i, ret;
+
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
+  if (unix_addr(host, &sun, &hints.ai_addrlen)) {
+    memcpy(&unix_dest, &hints, sizeof(unix_dest));
+    unix_dest.ai_family = AF_UNIX;
+    unix_dest.ai_addr = (struct sockaddr *)&sun;
+    dest = &unix_dest;
+  } else if ((ret = getaddrinfo(host, port, &hints, &dest))) {
+    ERR("getaddrinfo(): %s\n", gai_strerror(ret));
+    return 2;
+  }
+  w = calloc(nconns, sizeof(struct worker_s));
+  if (!w) { ERR("loadgen: unable to malloc() workers\n"); return 2; }
+
+  printf("[*] %s %s: %d %s, %d byte messages, %s, %d s\n",
+         tcp ? "tcp" : "udp", mode == ECHO ? "echo" : "sink", nconns,
+         tcp ? "connections" : "flows", msgsize,
+         churn ? "new connection per message" : rate > 0 ? "fixed rate" : "closed loop",
+         duration);
+  start = now_us();
+  deadline = start + (uint64_t)duration*1000000;
+  for (i = 0; i < nconns; i++)
+    if (pthread_create(&w[i].th, NULL, client_worker, &w[i])) {
+      ERR("loadgen: unable to start worker %d\n", i);
+      return 2;
+    }
+  memset(&total, '\0', sizeof(total));
+  for (i = 0; i < nconns; i++) {
+    pthread_join(w[i].th, NULL);
+    total.bytes_out += w[i].bytes_out;
+    total.bytes_in += w[i].bytes_in;
+    total.msgs += w[i].msgs;
+    total.conns += w[i].conns;
+    total.conn_us += w[i].conn_us;
+    total.errors += w[i].errors;
+    total.nlat += w[i].nlat;
+  }
+  elapsed = now_us() - start;
+  secs = elapsed / 1e6;
+
+  printf("[+] connections: %llu (%.1f/s), connect() avg %.1f us\n",
+         (unsigned long long)total.conns, total.conns/secs,
+         total.conns ? (double)total.conn_us/total.conns : 0.0);
+  printf("[+] messages: %llu (%.1f/s), errors: %llu\n",
+         (unsigned long long)total.msgs, total.msgs/secs,
+         (unsigned long long)total.errors);
+  printf("[+] throughput: %.3f Gbit/s out, %.3f Gbit/s in\n",
+         total.bytes_out*8/secs/1e9, total.bytes_in*8/secs/1e9);
+
+  if (total.nlat) {
+    size_t n = 0;
+    all = malloc(total.nlat*sizeof(uint32_t));
+    if (!all) { ERR("loadgen: unable to malloc() samples\n"); return 2; }
+    for (i = 0; i < nconns; i++) {
+      memcpy(&all[n], w[i].lat, w[i].nlat*sizeof(uint32_t));
+      n += w[i].nlat;
+      free(w[i].lat);
+    }
+    qsort(all, n, sizeof(uint32_t), cmp_u32);
+    printf("[+] latency (us): p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+           all[n*50/100], all[n*90/100], all[n*99/100], all[n*999/1000],
+           all[n-1]);
+    free(all);
+  }
+  free(w);
+  if (dest != &unix_dest) freeaddrinfo(dest);
+  return total.msgs ? 0 : 1;
+}
+
+/// Serve a single tcp connection.
+/// @param arg the accepted socket.
+void *server_conn(void *arg) {
+  int sd = (int)(intptr_t)arg;
+  static char discard[MAX_MSG];
+  char *b = (mode == ECHO) ? malloc(MAX_MSG) : discard;
+  ssize_t rd;
+
+  if (!b) { close(sd); return NULL; }
+  while ((rd = read(sd, b, MAX_MSG)) > 0)
+    if ((mode == ECHO) && write_all(sd, b, rd)) break;
+  close(sd);
+  if (mode == ECHO) free(b);
+  return NULL;
+}
+
+/// Run the echo/sink server forever.
+/// @param port port to listen on, on all local addresses.
+int server(const char *port) {
+  struct addrinfo hints, *res, unix_res;
+  struct sockaddr_un sun;
+  int lsock, one = 1, ret;
+
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_INET6;
+  hints.ai_flags = AI_PASSIVE;
+  hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
+  if (unix_addr(port, &sun, &hints.ai_addrlen)) {
+    memcpy(&unix_res, &hints, sizeof(unix_res));
+    unix_res.ai_family = AF_UNIX;
+    unix_res.ai_addr = (struct sockaddr *)&sun;
+    res = &unix_res;
+    unlink(sun.sun_path);
+  } else if ((ret = getaddrinfo(NULL, port, &hints, &res))) {
+    hints.ai_family = AF_INET;
+    if ((ret = getaddrinfo(NULL, port, &hints, &res))) {
+      ERR("getaddrinfo(): %s\n", gai_strerror(ret));
+      return 2;
+    }
+  }
+  if ((lsock = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0) {
+    perror("socket()");
+    return 2;
+  }
+  setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (res->ai_family == AF_INET6) {
+    one = 0;
+    setsockopt(lsock, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+  }
+  if (bind(lsock, res->ai_addr, res->ai_addrlen) ||
+      (tcp && listen(lsock, 1024))) {
+    perror("bind()/listen()");
+    return 2;
+  }
+  if (res != &unix_res) freeaddrinfo(res);
+  printf("[+] %s server listening on port %s\n", mode == ECHO ? "echo" : "sink", port);
+
+  if (tcp) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 64*1024);
+    for (;;) {
+      pthread_t th;
+      int sd = accept(lsock, NULL, NULL);
+      if (sd < 0) {
+        if (errno == EINTR) continue;
+        perror("accept()");
+        return 2;
+      }
+      one = 1;
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (pthread_create(&th, &attr, server_conn, (void *)(intptr_t)sd))
+        close(sd);
+    }
+  } else {
+    static char b[MAX_MSG];
+    for (;;) {
+      struct sockaddr_storage s;
+      socklen_t l = sizeof(s);
+      ssize_t rd = recvfrom(lsock, b, sizeof(b), 0, (struct sockaddr *)&s, &l);
+      if (rd < 0) continue;
+      if (mode == ECHO) sendto(lsock, b, rd, 0, (struct sockaddr *)&s, l);
+    }
+  }
+  return 0;
+}
+
+/// This is main...
+int main(int argc, char *argv[]) {
+  int opt, is_server;
+
+  if (argc < 2) usage_hints("missing role");
+  if (!strcmp(argv[1], "server")) is_server = 1;
+  else if (!strcmp(argv[1], "client")) is_server = 0;
+  else usage_hints("role should be server or client");
+  argc--; argv++;
+
+  while ((opt = getopt(argc, argv, "um:c:s:d:r:C")) != -1) {
+    switch (opt) {
+      case 'u': tcp = 0; break;
+      case 'm':
+        if (!strcmp(optarg, "echo")) mode = ECHO;
+        else if (!strcmp(optarg, "sink")) mode = SINK;
+        else usage_hints("mode should be echo or sink");
+        break;
+      case 'c': nconns = atoi(optarg); break;
+      case 's': msgsize = atoi(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'C': churn = 1; break;
+      default: usage_hints("unknown option");
+    }
+  }
+  if ((nconns < 1) || (msgsize < 1) || (msgsize > MAX_MSG) || (duration < 1))
+    usage_hints("invalid numeric option");
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (is_server) {
+    if (optind != argc-1) usage_hints("server needs a port");
+    return server(argv[optind]);
+  }
+  if (optind != argc-2) usage_hints("client needs host and port");
+  return client(argv[optind], argv[optind+1]);
+}
+
+// vim:sw=2:sta:et:
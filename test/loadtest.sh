@@ -0,0 +1,92 @@
+#!/bin/sh
+# netsed load test
+#
+# Runs netsed between test/loadgen client and server and prints throughput,
+# message rate, connection setup rate and latency percentiles for a set of
+# tcp and udp scenarios. Everything runs on loopback; when unprivileged user
+# namespaces are available the whole test is moved into a private network
+# namespace so no outside network is touched.
+#
+# Tunables (environment): DURATION, CONNS, SIZE, RATE, LPORT, RPORT, RULES.
+# Unix socket scenarios use loadtest_*.sock in the test directory.
+
+cd "$(dirname "$0")" || exit 1
+
+if [ -z "$LOADTEST_NETNS" ] && unshare -rn true 2>/dev/null; then
+  LOADTEST_NETNS=1 exec unshare -rn sh -c 'ip link set lo up 2>/dev/null || ifconfig lo up; exec sh ./loadtest.sh'
+fi
+
+NETSED=../netsed
+LOADGEN=./loadgen
+DURATION=${DURATION:-5}
+CONNS=${CONNS:-16}
+SIZE=${SIZE:-512}
+RATE=${RATE:-2000}
+LPORT=${LPORT:-20100}
+RPORT=${RPORT:-20101}
+LUNIX=unix:loadtest_netsed.sock
+RUNIX=unix:loadtest_server.sock
+# length preserving rules that do not match the 'x' payload
+RULES=${RULES:-"s/andrew/mike%00%00 s/Host:%20a/Host:%20b"}
+
+SERVER_PID=
+NETSED_PID=
+
+cleanup() {
+  [ -n "$NETSED_PID" ] && kill -INT $NETSED_PID 2>/dev/null && wait $NETSED_PID 2>/dev/null
+  [ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null && wait $SERVER_PID 2>/dev/null
+  NETSED_PID=
+  SERVER_PID=
+}
+trap cleanup EXIT INT TERM
+
+# start_pair proto lport rhost rport: start the echo server on rport (or rhost
+# for a unix socket) and netsed in front of it.
+start_pair() {
+  proto=$1
+  if [ "$proto" = udp ]; then uflag=-u; else uflag=; fi
+  case $3 in unix:*) sport=$3;; *) sport=$4;; esac
+  $LOADGEN server $uflag -m ${MODE:-echo} $sport > /dev/null &
+  SERVER_PID=$!
+  $NETSED $NETSED_OPTS $proto $2 $3 $4 $RULES > loadtest_netsed.log &
+  NETSED_PID=$!
+  i=0
+  until grep -q '^\[+\] Listening on port' loadtest_netsed.log 2>/dev/null; do
+    i=$((i+1))
+    if [ $i -gt 50 ]; then echo "netsed did not start"; cat loadtest_netsed.log; exit 1; fi
+    sleep 0.1
+  done
+}
+
+# scenario title proto loadgen-options...
+# The LSPEC (netsed lport) and RSPEC (netsed rhost rport) variables select
+# unix sockets instead of loopback tcp/udp, NETSED_OPTS adds netsed options.
+scenario() {
+  title=$1; proto=$2; shift 2
+  echo
+  echo "=== $title"
+  lspec=${LSPEC:-$LPORT}
+  start_pair $proto $lspec ${RSPEC:-127.0.0.1 $RPORT}
+  if [ "$proto" = udp ]; then uflag=-u; else uflag=; fi
+  case $lspec in unix:*) dest="$lspec 0";; *) dest="127.0.0.1 $lspec";; esac
+  $LOADGEN client $uflag -d $DURATION "$@" $dest
+  cleanup
+}
+
+[ -x $NETSED ] || { echo "build netsed first"; exit 1; }
+[ -x $LOADGEN ] || { echo "build loadgen first"; exit 1; }
+
+echo "netsed load test: ${DURATION}s per scenario, rules: $RULES"
+# each unix socket scenario runs next to the loopback one it compares with
+scenario "tcp closed loop, 1 connection" tcp -c 1 -s $SIZE
+scenario "tcp closed loop, $CONNS connections" tcp -c $CONNS -s $SIZE
+LSPEC=$LUNIX RSPEC="$RUNIX 0" scenario "unix stream closed loop, $CONNS connections" tcp -c $CONNS -s $SIZE
+scenario "tcp bulk, 16KB messages" tcp -c 4 -s 16384
+LSPEC=$LUNIX RSPEC="$RUNIX 0" scenario "unix stream bulk, 16KB messages" tcp -c 4 -s 16384
+scenario "tcp fixed rate ${RATE}/s" tcp -c $CONNS -s $SIZE -r $RATE
+scenario "tcp connection setup rate" tcp -c 4 -s 64 -C
+NETSED_OPTS="-p 8" scenario "tcp connection setup rate, 8 pre-connected" tcp -c 4 -s 64 -C
+scenario "udp closed loop, $CONNS flows" udp -c $CONNS -s $SIZE
+LSPEC=$LUNIX RSPEC="$RUNIX 0" scenario "unix datagram closed loop, $CONNS flows" udp -c $CONNS -s $SIZE
+scenario "udp fixed rate ${RATE}/s" udp -c $CONNS -s $SIZE -r $RATE
+rm -f loadtest_netsed.log loadtest_server.sock
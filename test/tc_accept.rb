@@ -0,0 +1,60 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for accepting tcp connections
+# in class TC_AcceptTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed tcp accept options
+class TC_AcceptTest < Test::Unit::TestCase
+
+  # Check a burst of connections, queued before netsed accepts them, is
+  # forwarded entirely.
+  def test_burst
+    dts = TCPServer.new(SERVER, RPORT)
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike', options: '-l 256')
+    # stop netsed while the clients connect, so that they queue up
+    Process.kill('STOP', netsed.pid)
+    clients = 100.times.map do |i|
+      c = TCPSocket.new(SERVER, LPORT)
+      c.write("andrew #{i}")
+      c
+    end
+    Process.kill('CONT', netsed.pid)
+    got = 100.times.map do
+      assert_not_nil(IO.select([dts], nil, nil, 5), 'connection not forwarded')
+      s = dts.accept
+      data = s.recv(100)
+      s.close
+      data
+    end
+    assert_equal(100.times.map { |i| "mike #{i}" }.sort, got.sort)
+  ensure
+    clients.each { |c| c.close } if clients
+    dts.close if dts
+    netsed.kill if netsed
+  end
+
+  # Check TCP_DEFER_ACCEPT waits for the client data before connecting to
+  # the server.
+  def test_defer_accept
+    dts = TCPServer.new(SERVER, RPORT)
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike', options: '-A 5')
+    cli = TCPSocket.new(SERVER, LPORT)
+    assert_nil(IO.select([dts], nil, nil, 0.5), 'connection accepted without data')
+    cli.write('andrew')
+    assert_not_nil(IO.select([dts], nil, nil, 5), 'connection not forwarded')
+    s = dts.accept
+    assert_equal('mike', s.recv(100))
+  ensure
+    cli.close if cli
+    s.close if s
+    dts.close if dts
+    netsed.kill if netsed
+  end
+
+end
+
+# vim:sw=2:sta:et:
@@ -0,0 +1,97 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for load balancing between several servers
+# in class TC_BalanceTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed load balancing and health checking
+class TC_BalanceTest < Test::Unit::TestCase
+
+  SERVER2='127.0.0.2'
+
+  def setup
+    @servers = [TCPServer.new(SERVER, RPORT), TCPServer.new(SERVER2, RPORT)]
+    @socks = []
+  end
+
+  def teardown
+    @socks.each { |s| s.close }
+    @servers.each { |s| s.close }
+  end
+
+  # Connect a client through netsed, returns the index of the server that
+  # got the connection and checks the rules applied.
+  def connect_client
+    cli = TCPSocket.new(SERVER, LPORT)
+    @socks << cli
+    cli.write('andrew')
+    ready = IO.select(@servers, nil, nil, 5)
+    assert_not_nil(ready, 'no server got the connection')
+    s = ready[0][0].accept
+    @socks << s
+    assert_equal('mike', s.recv(100))
+    return @servers.index(ready[0][0])
+  end
+
+  # Check round robin alternates between the servers.
+  def test_roundrobin
+    netsed = NetsedRun.new('tcp', LPORT, "#{SERVER},#{SERVER2}", RPORT, 's/andrew/mike')
+    got = 4.times.map { connect_client }
+    assert_equal([0, 1, 0, 1], got)
+  ensure
+    netsed.kill if netsed
+  end
+
+  # Check least connections goes to the server with fewer open connections.
+  def test_leastconn
+    netsed = NetsedRun.new('tcp', LPORT, "#{SERVER},#{SERVER2}", RPORT, 's/andrew/mike', options: '-b lc')
+    first = connect_client
+    assert_equal(1-first, connect_client)
+    # close the connection of the first server
+    @socks[1].close
+    @socks.delete_at(1)
+    # netsed does not report it, let it notice
+    sleep 0.5
+    assert_equal(first, connect_client)
+  ensure
+    netsed.kill if netsed
+  end
+
+  # Check the same client address always goes to the same server.
+  def test_hash
+    netsed = NetsedRun.new('tcp', LPORT, "#{SERVER},#{SERVER2}", RPORT, 's/andrew/mike', options: '-b hash')
+    first = connect_client
+    3.times { assert_equal(first, connect_client) }
+  ensure
+    netsed.kill if netsed
+  end
+
+  # Check a refused connection fails over to the next server.
+  def test_failover
+    netsed = NetsedRun.new('tcp', LPORT, "127.0.0.3,#{SERVER}", RPORT, 's/andrew/mike')
+    assert_equal(0, connect_client)
+    # known down: not tried again
+    assert_equal(0, connect_client)
+    data = netsed.kill
+    assert_equal(1, data.scan(/Server 127.0.0.3 is down/).size)
+    assert_equal(1, data.scan(/Forwarding connection to 127.0.0.3/).size)
+  ensure
+    netsed.kill if netsed && !data
+  end
+
+  # Check health probes find a server down, then up, without any client.
+  def test_probe
+    netsed = NetsedRun.new('tcp', LPORT, "127.0.0.3,#{SERVER}", RPORT, 's/andrew/mike', options: '-H 1')
+    assert_match(/Server 127.0.0.3 is down/, netsed.wait_for(/Server .* is/))
+    @servers << TCPServer.new('127.0.0.3', RPORT)
+    assert_match(/Server 127.0.0.3 is up/, netsed.wait_for(/Server .* is/))
+  ensure
+    netsed.kill if netsed
+  end
+
+end
+
+# vim:sw=2:sta:et:
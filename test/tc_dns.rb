@@ -0,0 +1,109 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for the DNS re-resolution of server names
+# in class TC_DNSTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed DNS re-resolution
+class TC_DNSTest < Test::Unit::TestCase
+
+  HOSTS='dns_hosts'
+  DNSPORT=20053
+
+  # Minimal DNS server answering A queries with @addrs and a TTL of 1,
+  # or NXDOMAIN when @addrs is nil. AAAA queries get no answer records.
+  def start_dns
+    @dns = UDPSocket.new
+    @dns.bind('127.0.0.1', DNSPORT)
+    @queries = 0
+    @dns_thread = Thread.new do
+      loop do
+        q, from = @dns.recvfrom(512)
+        @queries += 1
+        qend = 12
+        qend += q.getbyte(qend) + 1 while q.getbyte(qend) != 0
+        qtype = q[qend+1, 2].unpack1('n')
+        question = q[12..qend+4]
+        answers = (qtype == 1 && @addrs) ? @addrs : []
+        r = q[0, 2] + [@addrs ? 0x8180 : 0x8183, 1, answers.size, 0, 0].pack('n5') + question
+        answers.each do |a|
+          r << [0xc00c, 1, 1, 1, 4].pack('nnnNn') + a.split('.').map(&:to_i).pack('C4')
+        end
+        @dns.send(r, 0, from[3], from[1])
+      end
+    end
+  end
+
+  # netsed starts with 'backend.test' as 127.0.0.1 from a private /etc/hosts
+  def setup
+    omit('needs unshare') unless system('unshare -rm true 2>/dev/null')
+    File.write(HOSTS, "127.0.0.1 backend.test\n")
+    @wrapper = "unshare -rm sh -c 'mount --bind #{HOSTS} /etc/hosts && exec \"$0\" \"$@\"'"
+    @addrs = ['127.0.0.1']
+    start_dns
+    @servers = [TCPServer.new('127.0.0.1', RPORT), TCPServer.new('127.0.0.2', RPORT)]
+    @socks = []
+  end
+
+  def teardown
+    @dns_thread.kill if @dns_thread
+    @dns.close if @dns
+    @socks.each { |s| s.close }
+    @servers.each { |s| s.close } if @servers
+    File.delete(HOSTS) if File.exist?(HOSTS)
+  end
+
+  # Connect a client through netsed, returns the index of the server that
+  # got the connection.
+  def connect_client
+    cli = TCPSocket.new('127.0.0.1', LPORT)
+    @socks << cli
+    cli.write('andrew')
+    ready = IO.select(@servers, nil, nil, 5)
+    assert_not_nil(ready, 'no server got the connection')
+    s = ready[0][0].accept
+    @socks << s
+    assert_equal('mike', s.recv(100))
+    return @servers.index(ready[0][0])
+  end
+
+  # Check a new address is used after the TTL, without restart.
+  def test_address_change
+    netsed = NetsedRun.new('tcp', LPORT, 'backend.test', RPORT, 's/andrew/mike',
+                           options: "-D 127.0.0.1,#{DNSPORT}", wrapper: @wrapper)
+    assert_equal(0, connect_client)
+    @addrs = ['127.0.0.2']
+    assert_match(/Server backend.test now resolves to 127.0.0.2/, netsed.wait_for(/resolves/))
+    assert_equal(1, connect_client)
+  ensure
+    netsed.kill if netsed
+  end
+
+  # Check a failed resolution keeps the known addresses.
+  def test_failure_keeps_addresses
+    @addrs = nil
+    netsed = NetsedRun.new('tcp', LPORT, 'backend.test', RPORT, 's/andrew/mike',
+                           options: "-D 127.0.0.1,#{DNSPORT}", wrapper: @wrapper)
+    assert_match(/DNS resolution of backend.test failed/, netsed.wait_for(/DNS/))
+    assert_equal(0, connect_client)
+  ensure
+    netsed.kill if netsed
+  end
+
+  # Check numeric servers are not resolved again.
+  def test_numeric_not_resolved
+    netsed = NetsedRun.new('tcp', LPORT, '127.0.0.1', RPORT, 's/andrew/mike',
+                           options: "-D 127.0.0.1,#{DNSPORT}")
+    assert_equal(0, connect_client)
+    sleep 1.5
+    assert_equal(0, @queries)
+  ensure
+    netsed.kill if netsed
+  end
+
+end
+
+# vim:sw=2:sta:et:
@@ -0,0 +1,66 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for racing the connections to the addresses
+# of a server in class TC_EyeballsTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed happy eyeballs connections
+class TC_EyeballsTest < Test::Unit::TestCase
+
+  HOSTS='eyeballs_hosts'
+
+  # netsed sees a private /etc/hosts where 'twohomed' is ::1 and 127.0.0.1
+  def setup
+    omit('needs unshare') unless system('unshare -rm true 2>/dev/null')
+    File.write(HOSTS, "127.0.0.1 twohomed\n::1 twohomed\n")
+    @wrapper = "unshare -rm sh -c 'mount --bind #{HOSTS} /etc/hosts && exec \"$0\" \"$@\"'"
+    @socks = []
+  end
+
+  def teardown
+    @socks.each { |s| s.close }
+    File.delete(HOSTS) if File.exist?(HOSTS)
+  end
+
+  # Check a server not answering on its first address does not delay the
+  # connection to the second one.
+  def test_slow_first_address
+    # ::1 accept queue is full: its SYNs are dropped
+    slow = Socket.new(:INET6, :STREAM)
+    @socks << slow
+    slow.bind(Addrinfo.tcp('::1', RPORT))
+    slow.listen(0)
+    3.times do
+      c = Socket.new(:INET6, :STREAM)
+      @socks << c
+      begin
+        c.connect_nonblock(Addrinfo.tcp('::1', RPORT))
+      rescue IO::WaitWritable
+      end
+    end
+    dts = TCPServer.new('127.0.0.1', RPORT)
+    @socks << dts
+
+    netsed = NetsedRun.new('tcp', LPORT, 'twohomed', RPORT, 's/andrew/mike', wrapper: @wrapper)
+    start = Time.now
+    # listening on ipv6, the family of the first address
+    cli = TCPSocket.new('::1', LPORT)
+    @socks << cli
+    cli.write('andrew')
+    assert_not_nil(IO.select([dts], nil, nil, 5), 'no connection to the second address')
+    s = dts.accept
+    @socks << s
+    assert_equal('mike', s.recv(100))
+    assert_operator(Time.now - start, :<, 0.9)
+    data = netsed.kill
+    assert_match(/Forwarding connection to ::1,#{RPORT}\n.*Forwarding connection to 127.0.0.1/, data)
+  ensure
+    netsed.kill if netsed && !data
+  end
+
+end
+
+# vim:sw=2:sta:et:
@@ -0,0 +1,58 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for tcp idle timeouts and keepalive
+# in class TC_IdleTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed tcp idle timeout
+class TC_IdleTest < Test::Unit::TestCase
+
+  # Check an idle connection is closed on both sides and counted, while an
+  # active one is kept.
+  def test_idle_timeout
+    dts = TCPServer.new(SERVER, RPORT)
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike', options: '-i 1')
+    idle = TCPSocket.new(SERVER, LPORT)
+    sidle = dts.accept
+    active = TCPSocket.new(SERVER, LPORT)
+    sactive = dts.accept
+    # active sends data every 0.5 s
+    4.times do
+      sleep 0.5
+      active.write('andrew')
+      assert_equal('mike', sactive.recv(100))
+    end
+    netsed.wait_for(/Closing connection idle/)
+    assert_not_nil(IO.select([sidle], nil, nil, 2), 'server side not closed')
+    assert_equal('', sidle.recv(100).to_s)
+    assert_equal('', idle.recv(100).to_s)
+    Process.kill('USR1', netsed.pid)
+    assert_match(/Stats: 2 connections, 1 open, 1 idle tcp closed/, netsed.wait_for(/Stats/))
+  ensure
+    [idle, sidle, active, sactive, dts].each { |s| s.close if s }
+    netsed.kill if netsed
+  end
+
+  # Check keepalive is set on both connections.
+  def test_keepalive
+    dts = TCPServer.new(SERVER, RPORT)
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike', options: '-k 7,3,2')
+    cli = TCPSocket.new(SERVER, LPORT)
+    s = dts.accept
+    cli.write('andrew')
+    assert_equal('mike', s.recv(100))
+    # the sockets of netsed, seen from its side in ss output
+    out = `ss -tnoH state established '( sport = :#{LPORT} or dport = :#{RPORT} )' 2>/dev/null`
+    omit('needs ss') if out.empty?
+    assert_equal(2, out.scan(/keepalive/).size, out)
+  ensure
+    [cli, s, dts].each { |x| x.close if x }
+    netsed.kill if netsed
+  end
+
+end
+
+# vim:sw=2:sta:et:
@@ -0,0 +1,78 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for several listeners given in a configuration
+# file in class TC_ListenTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed configuration files
+class TC_ListenTest < Test::Unit::TestCase
+  CONFIG='tc_listen.conf'
+  RULEFILE='tc_listen_rules.txt'
+  DEFRULEFILE='tc_listen_default.txt'
+  LPORT2=LPORT+2
+  RPORT2=RPORT+2
+
+  def setup
+    File.open(CONFIG, 'w') { |f|
+      f.puts '# netsed test configuration'
+      f.puts "tcp #{LPORT} #{SERVER} #{RPORT} #{RULEFILE}"
+      f.puts ''
+      f.puts "tcp #{LPORT2} #{SERVER} #{RPORT2} # default rules"
+      f.puts "udp #{LPORT} #{SERVER} #{RPORT} #{RULEFILE}"
+    }
+    File.open(RULEFILE, 'w') { |f| f.puts 's/andrew/mike' }
+    File.open(DEFRULEFILE, 'w') { |f| f.puts 's/andrew/bob' }
+  end
+
+  def teardown
+    [CONFIG, RULEFILE, DEFRULEFILE].each { |f| File.delete(f) if File.exist?(f) }
+  end
+
+  # Check each listener forwards to its upstream with its own rules.
+  def test_config_listeners
+    netsed = NetsedRun.new('', '', '', '', options: "-c #{CONFIG} -f #{DEFRULEFILE}")
+
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'test andrew')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    assert_equal('test mike', datarecv)
+
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT2, 'test andrew')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT2, 100)
+    serv.join
+    assert_equal('test bob', datarecv)
+
+    serv = UDPSocket.new
+    serv.bind(SERVER, RPORT)
+    UDPSingleDataSend(SERVER, LPORT, 'udp andrew')
+    datarecv = serv.recvfrom(100)[0]
+    serv.close
+    assert_equal('udp mike', datarecv)
+  ensure
+    netsed.kill if netsed
+  end
+
+  # Check a listener on the command line can be mixed with the configuration.
+  def test_config_and_command_line
+    File.open(CONFIG, 'w') { |f| f.puts "tcp #{LPORT2} #{SERVER} #{RPORT2} #{RULEFILE}" }
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/joe', options: "-c #{CONFIG}")
+
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'test andrew')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    assert_equal('test joe', datarecv)
+
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT2, 'test andrew')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT2, 100)
+    serv.join
+    assert_equal('test mike', datarecv)
+  ensure
+    netsed.kill if netsed
+  end
+
+end
+
+# vim:sw=2:sta:et:
@@ -0,0 +1,111 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for the rule chosen when several match at the
+# same offset (-m option) in class TC_MatchTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed leftmost-first and leftmost-longest matching
+class TC_MatchTest < Test::Unit::TestCase
+  RULEFILE='tc_match_rules.txt'
+
+  # Patterns of rule sets run by each matching algorithm, rule i replaces
+  # its pattern with [i]: one rule and masked ones, few, packed, hash, trie.
+  SETS = [%w(ab a%??b), %w(ab abab ba a%??b aB/i), %w(a ab abb),
+          %w(ab abab ba bab aab bb abb baba aaab), %w(a ab ba b aaab)]
+
+  def setup
+    @server = UDPSocket.new
+    @server.bind(SERVER, RPORT)
+  end
+
+  def teardown
+    @server.close
+    File.delete(RULEFILE) if File.exist?(RULEFILE)
+    File.delete("#{RULEFILE}.db") if File.exist?("#{RULEFILE}.db")
+  end
+
+  # netsed rules of the patterns _set_.
+  def rules(set)
+    set.each_with_index.map { |p, i|
+      p, flags = p.split('/')
+      "s/#{p}/[#{i}]" + (flags ? "/#{flags}" : '')
+    }
+  end
+
+  # Apply the patterns _set_ to _data_: at each offset the first rule
+  # matching there, or the first of the longest ones if _longest_.
+  def sed(set, data, longest)
+    res = set.map { |p|
+      p, flags = p.split('/')
+      Regexp.new('\G' + p.gsub('%??', '.'), Regexp::MULTILINE | (flags ? Regexp::IGNORECASE : 0))
+    }
+    out = ''.b
+    i = 0
+    while i < data.size
+      best = nil
+      res.each_with_index { |re, k|
+        m = re.match(data, i)
+        next unless m
+        best = [k, m[0].size] if !best || (longest && (m[0].size > best[1]))
+        break unless longest
+      }
+      if best
+        out << "[#{best[0]}]"
+        i += best[1]
+      else
+        out << data[i]
+        i += 1
+      end
+    end
+    return out
+  end
+
+  # Send datagrams of random a, b and A through netsed with the rules of
+  # _set_, check the result with sed().
+  def check_set(set, options, longest)
+    netsed = NetsedRun.new('udp', LPORT, SERVER, RPORT, *rules(set), options: options)
+    netsed.drain
+    srand(7)
+    [2000, 333, 40].each { |n|
+      data = (1..n).map { ['a', 'a', 'a', 'b', 'b', 'A'][rand(6)] }.join.b
+      UDPSingleDataSend(SERVER, LPORT, data)
+      got = @server.recvfrom(65536)[0]
+      assert_equal(sed(set, data, longest), got, "rules #{set.inspect} #{options}")
+    }
+  ensure
+    netsed.kill if netsed
+  end
+
+  # Check the default and '-m first' both apply the first matching rule.
+  def test_first
+    SETS.each { |set|
+      check_set(set, '', false)
+      check_set(set, '-m first', false)
+    }
+  end
+
+  # Check '-m longest' applies the longest matching rule with every
+  # matching algorithm.
+  def test_longest
+    SETS.each { |set| check_set(set, '-m longest', true) }
+  end
+
+  # Check a 'match' line of a rule file, text and compiled, overrides -m.
+  def test_rule_file
+    File.open(RULEFILE, 'w') { |f| f.puts 'match longest', 's/a/x', 's/ab/y' }
+    `../netsed compile #{RULEFILE} -o #{RULEFILE}.db`
+    assert_equal(0, $?.exitstatus, 'netsed compile failed')
+    [RULEFILE, "#{RULEFILE}.db"].each { |f|
+      netsed = NetsedRun.new('udp', LPORT, SERVER, RPORT, options: "-m first -f #{f}")
+      UDPSingleDataSend(SERVER, LPORT, 'aab')
+      assert_equal('xy', @server.recvfrom(100)[0], f)
+      netsed.kill
+    }
+  end
+
+end
+
+# vim:sw=2:sta:et:
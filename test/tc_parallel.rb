@@ -0,0 +1,76 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for the scanning of large buffers by several
+# threads in class TC_ParallelTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed -j option
+class TC_ParallelTest < Test::Unit::TestCase
+
+  # Rules, and for sed() the same as regexps matching at an offset, their
+  # replacement and pattern length.
+  RULES = [['s/abab/X', /\Gabab/n, 'X', 4], ['s/ba/Y', /\Gba/n, 'Y', 2],
+           ['s/aaaaaaaaab/L', /\Gaaaaaaaaab/n, 'L', 10], ['s/b%??b/W%00', /\Gb.b/mn, "W\0", 3]]
+
+  def setup
+    @server = UDPSocket.new
+    @server.bind(SERVER, RPORT)
+  end
+
+  def teardown
+    @server.close
+  end
+
+  # Apply RULES to _data_ as netsed does: at each offset the first rule
+  # matching there.
+  def sed(data)
+    out = ''.b
+    i = 0
+    while i < data.size
+      r = RULES.find { |rule| data.match?(rule[1], i) }
+      if r
+        out << r[2]
+        i += r[3]
+      else
+        out << data[i]
+        i += 1
+      end
+    end
+    return out
+  end
+
+  # Send datagrams of random a and b through netsed, returns netsed output.
+  def check_datagrams(options, rules, sizes)
+    netsed = NetsedRun.new('udp', LPORT, SERVER, RPORT, *rules, options: options)
+    netsed.drain
+    srand(42)
+    sizes.each { |n|
+      data = (1..n).map { rand(10) < 7 ? 'a' : 'b' }.join.b
+      UDPSingleDataSend(SERVER, LPORT, data)
+      got = @server.recvfrom(65536)[0]
+      assert_equal(sed(data), got, "datagram of #{n} bytes")
+    }
+    return out = netsed.kill
+  ensure
+    netsed.kill if netsed && !out
+  end
+
+  # Check chunks scanned by threads give the same result as one thread.
+  def test_parallel
+    data = check_datagrams('-j 3,1000', RULES.map { |r| r[0] }, [60000, 33333, 999, 5000, 7])
+    assert_match(/Scanning buffers of 1000 bytes or more with 4 threads/, data)
+    assert_match(/3 scanned in parallel/, data)
+  end
+
+  # Check rules with a TTL are not scanned in parallel.
+  def test_parallel_ttl
+    data = check_datagrams('-j 3,1000', RULES.map { |r| r[0] } + ['s/zz/Q/10'], [60000, 5000])
+    assert_match(/0 scanned in parallel/, data)
+  end
+
+end
+
+# vim:sw=2:sta:et:
@@ -0,0 +1,59 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for the pre-connected upstream connection pool
+# in class TC_PoolTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed upstream connection pool
+class TC_PoolTest < Test::Unit::TestCase
+
+  # Check connections are opened before any client, used, and refilled.
+  def test_pool_preconnects
+    dts = TCPServer.new(SERVER, RPORT)
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike', options: '-p 2')
+    # opened without any client
+    pooled = [dts.accept, dts.accept]
+
+    cli = TCPSocket.new(SERVER, LPORT)
+    cli.write('test andrew')
+    ready = IO.select(pooled, nil, nil, 5)
+    assert_not_nil(ready, 'no data on pooled connections')
+    s = ready[0][0]
+    assert_equal('test mike', s.recv(100))
+    s.write('andrew back')
+    assert_equal('mike back', cli.recv(100))
+
+    # the used connection is replaced
+    assert_not_nil(IO.select([dts], nil, nil, 5), 'pool not refilled')
+    pooled << dts.accept
+  ensure
+    cli.close if cli
+    pooled.each { |p| p.close } if pooled
+    dts.close if dts
+    netsed.kill if netsed
+  end
+
+  # Check a pooled connection closed by the server is not given to a client.
+  def test_pool_server_close
+    dts = TCPServer.new(SERVER, RPORT)
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike', options: '-p 1')
+    dts.accept.close
+    # reconnected
+    s = dts.accept
+    cli = TCPSocket.new(SERVER, LPORT)
+    cli.write('andrew')
+    assert_not_nil(IO.select([s], nil, nil, 5), 'no data on new pooled connection')
+    assert_equal('mike', s.recv(100))
+  ensure
+    cli.close if cli
+    s.close if s
+    dts.close if dts
+    netsed.kill if netsed
+  end
+
+end
+
+# vim:sw=2:sta:et:
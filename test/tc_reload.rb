@@ -0,0 +1,180 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for rule files and their reload on SIGHUP
+# in class TC_ReloadTest
+
+require 'test/unit'
+require 'test_helper'
+require 'thread'
+
+# Test Case for netsed rule file and SIGHUP reload
+class TC_ReloadTest < Test::Unit::TestCase
+  RULEFILE='tc_reload_rules.txt'
+
+  # Write _rules_ to the rule file
+  def write_rules(*rules)
+    File.open(RULEFILE, 'w') { |f|
+      f.puts '# netsed test rules'
+      rules.each { |r| f.puts r }
+    }
+  end
+
+  def teardown
+    File.delete(RULEFILE) if File.exist?(RULEFILE)
+  end
+
+  # Check rules are read from the file, in addition to command line ones.
+  def test_rule_file
+    write_rules('s/andrew/mike', '', 's/there/here')
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'test andrew is there, bob')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/bob/joe', options: "-f #{RULEFILE}")
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    netsed.kill
+    assert_equal('test mike is here, joe', datarecv)
+  end
+
+  # Check a compiled rule file gives the same result as the text one.
+  def test_compiled_rule_file
+    write_rules('s/andrew/mike/1', 's/andrew/bob', 's/and/&', 's/there/here')
+    `../netsed compile #{RULEFILE} -o #{RULEFILE}.db`
+    assert_equal(0, $?.exitstatus, 'netsed compile failed')
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'andrew and andrew there')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, options: "-f #{RULEFILE}.db")
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    netsed.kill
+    assert_equal('mike & bob here', datarecv)
+  ensure
+    File.delete("#{RULEFILE}.db") if File.exist?("#{RULEFILE}.db")
+  end
+
+  # Check masked rules keep their mask in a compiled rule file.
+  def test_compiled_masked_rule_file
+    write_rules('s/andrew/mike/1', 's/th%?5r%??/THERE/1', 's/there/here')
+    `../netsed compile #{RULEFILE} -o #{RULEFILE}.db`
+    assert_equal(0, $?.exitstatus, 'netsed compile failed')
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'andrew thUre there')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, options: "-f #{RULEFILE}.db")
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    netsed.kill
+    assert_equal('mike THERE here', datarecv)
+  ensure
+    File.delete("#{RULEFILE}.db") if File.exist?("#{RULEFILE}.db")
+  end
+
+  # Check a large rule set, text and compiled, keeps first rule wins.
+  def test_large_rule_file
+    write_rules('s/token42z/FIRST', *(1..5000).map { |i| "s/token#{i}z/R#{i}" }, 's/oken7z/NO')
+    `../netsed compile #{RULEFILE} -o #{RULEFILE}.db`
+    assert_equal(0, $?.exitstatus, 'netsed compile failed')
+    [RULEFILE, "#{RULEFILE}.db"].each { |f|
+      serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'token42z token7z token4999z token5001z')
+      netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, options: "-f #{f}")
+      datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+      serv.join
+      netsed.kill
+      assert_equal('FIRST R7 R4999 token5001z', datarecv)
+    }
+  ensure
+    File.delete("#{RULEFILE}.db") if File.exist?("#{RULEFILE}.db")
+  end
+
+  # Check new connections use reloaded rules.
+  def test_reload_new_connection
+    write_rules('s/andrew/mike')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, options: "-f #{RULEFILE}")
+
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'test andrew')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    assert_equal('test mike', datarecv, 'Before reload')
+
+    write_rules('s/andrew/bob')
+    Process.kill('HUP', netsed.pid)
+    netsed.wait_for(/^\[\+\] Reloaded/)
+
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'test andrew')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    assert_equal('test bob', datarecv, 'After reload')
+  ensure
+    netsed.kill
+  end
+
+  # Check global expire counts are shared by connections and survive a
+  # reload for unchanged rules.
+  def test_global_rule
+    write_rules('s/andrew/mike/3g', 's/bob/joe/1g')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, options: "-f #{RULEFILE}")
+    got = ['andrew andrew bob', 'andrew andrew bob'].map { |d|
+      serv = TCPServeSingleDataSender.new(SERVER, RPORT, d)
+      datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+      serv.join
+      datarecv
+    }
+    assert_equal(['mike mike joe', 'mike andrew bob'], got)
+
+    write_rules('s/andrew/mike/3g', 's/bob/joe/2g')
+    Process.kill('HUP', netsed.pid)
+    netsed.wait_for(/^\[\+\] Reloaded/)
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'andrew bob bob bob')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    assert_equal('andrew joe joe bob', datarecv)
+    data = netsed.kill
+    assert_match(%r{rule s/andrew/mike/3g has 0 uses left}, data)
+    assert_match(%r{rule s/bob/joe/2g has 0 uses left}, data)
+  ensure
+    netsed.kill if netsed && !data
+  end
+
+  # Check a bad rule file keeps the previous rules.
+  def test_reload_failure
+    write_rules('s/andrew/mike')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, options: "-f #{RULEFILE}")
+
+    write_rules('s/andrew')
+    Process.kill('HUP', netsed.pid)
+    netsed.wait_for(/^\[!\] Reload failed/)
+
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'test andrew')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    assert_equal('test mike', datarecv)
+  ensure
+    netsed.kill
+  end
+
+  # Check an established connection survives a reload, keeping the TTL
+  # of unchanged rules and applying the new ones.
+  def test_reload_keeps_connection
+    write_rules('s/andrew/mike/1', 's/there/here')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, options: "-f #{RULEFILE}")
+    step = Queue.new
+    serv = TCPServeSingleConnection.new(SERVER, RPORT) { |s|
+      s.write('andrew there')
+      step.pop
+      s.write('andrew there')
+    }
+    streamSock = TCPSocket.new(SERVER, LPORT)
+    datarecv = [ streamSock.recv(100) ]
+
+    write_rules('s/andrew/mike/1', 's/there/where')
+    Process.kill('HUP', netsed.pid)
+    netsed.wait_for(/^\[\+\] Reloaded/)
+    step << 1
+
+    datarecv << streamSock.recv(100)
+    streamSock.close
+    serv.join
+    assert_equal_objects(['mike here', 'andrew where'], datarecv)
+  ensure
+    netsed.kill
+  end
+
+end
+
+# vim:sw=2:sta:et:
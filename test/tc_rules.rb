@@ -45,11 +45,107 @@ class TC_RuleTest < Test::Unit::TestCase
     TCP_RuleCheck('a a aa aaa aaaa' ,"b b bb bbb bbbb", 's/a/b')
   end
 
+  # Check rules restricted to server to client data.
+  def test_server_direction_rule
+    TCP_RuleCheck('test andrew is there' ,'test mike is there', 's/andrew/mike/s', 's/there/here/c')
+  end
+
+  # Check rules restricted to client to server data.
+  def test_client_direction_rule
+    serv = TCPServeSingleDataReciever.new(SERVER, RPORT, 100)
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike/s', 's/there/here/1c')
+    TCPSingleDataSend(SERVER, LPORT, 'test andrew is there, there')
+    datarecv = serv.join
+    netsed.kill
+    assert_equal('test andrew is here, there', datarecv)
+  end
+
+  # Check rules restricted to a window of the stream.
+  def test_window_rule
+    TCP_RuleCheck('a a a a a a' ,'b c a a a c', 's/a/b/@0', 's/a/c/w3', 's/a/c/@10')
+  end
+
   # Check with 2 rules.
   def test_chain_2_rule
     TCP_RuleCheck('test andrew is there' ,'test mike is here', 's/andrew/mike', 's/there/here')
   end
 
+  # Check rules with wildcards: whole bytes, nibbles, mixed with literal
+  # rules, the first rule still wins at an offset.
+  def test_masked_rule
+    TCP_RuleCheck("\x17\x03\x01\x02\x00 \x17\x03\x01\x00", "X \x17\x03\x01\x00", 's/%17%03%??%??%00/X')
+    TCP_RuleCheck("a1 b2 \x23 \x13\x14", "a1 b2 N N\x14", 's/%?3/N')
+    TCP_RuleCheck('there here where', 'THERE h W', 's/th%?5re/THERE', 's/here/h', 's/w%??%??re/W', 's/h%6?r%??/H')
+    TCP_RuleCheck('abcabd abc abc abc', 'X Y Y abc', 's/abc%??bd/X', 's/ab%6?/Y/2', 's/abc/Z/w3')
+  end
+
+  # Check case insensitive rules, the replacement is sent as is.
+  def test_nocase_rule
+    TCP_RuleCheck('Host: a HOST: b host: c hOsT@ d', 'X-Host: a X-Host: b X-Host: c hOsT@ d', 's/host:/X-Host:/i')
+    # non letters are not folded, first rule wins with literal rules
+    TCP_RuleCheck('@b `B @B `b b B', 'Y `Q Y W Z Q', 's/b/Z', 's/@b/Y/i', 's/%60b/W', 's/B/Q/i')
+  end
+
+  # Check length preserving rules patch the data in place, until a rule
+  # changing the length applies.
+  def test_inplace_rule
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'andrew is there, andrew')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike%00%00/1', 's/there/where', 's/andrew/bob')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    data = netsed.kill
+    assert_equal("mike\0\0 is where, bob", datarecv)
+    assert_match(/Stats: 0 packets untouched, 0 rewritten in place, 1 rewritten by copy/, data)
+
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'andrew is there, andrew')
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/andrew/mike%00%00', 's/there/where')
+    datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+    serv.join
+    data = netsed.kill
+    assert_equal("mike\0\0 is where, mike\0\0", datarecv)
+    assert_match(/Done 3 replacements in place/, data)
+    assert_match(/Stats: 0 packets untouched, 1 rewritten in place, 0 rewritten by copy/, data)
+  end
+
+  # Check the matching algorithms chosen for various rule sets find the
+  # same matches: first rule wins, expire counts and windows still apply.
+  def test_kernels
+    # a single long rule
+    TCP_RuleCheck('xx andrewandrew andrew', 'xx mikemike andrew', 's/andrew/mike/2')
+    # a few short rules, overlapping
+    TCP_RuleCheck('a ab abc b', 'X Y Yc Z', 's/ab/Y', 's/a/X', 's/abc/Q', 's/b/Z')
+    # a few longer rules, overlapping
+    TCP_RuleCheck('andrew andy andrew', 'mike bob andrew', 's/andrew/mike/1', 's/andy/bob', 's/and/ZZZ/w3')
+    # many rules
+    rules = (1..20).map { |i| "s/key#{i}x/v#{i}" }
+    TCP_RuleCheck('key3x key20x key2x key3', 'v3 v20 v2 key3', *rules)
+    # the bench checks all algorithms agree
+    assert_match(/planned/, `../netsed bench 0.001`)
+    assert_equal(0, $?.exitstatus)
+  end
+
+  # Check a truncated or corrupted compiled rule file is refused, without
+  # crashing on offsets that would wrap around.
+  def test_corrupted_compiled
+    rules, db = 'tc_rules_db.txt', 'tc_rules_db.db'
+    File.write(rules, "s/andrew0andrew1/x\ns/bob/joe\n")
+    `../netsed compile #{rules} -o #{db}`
+    assert_equal(0, $?.exitstatus, 'netsed compile failed')
+    good = File.binread(db)
+    # from of the first rule near 2^64: from + fs wraps to a small offset
+    bad = good.dup
+    bad[good[32, 8].unpack1('Q<'), 8] = [2**64 - 8].pack('Q<')
+    { 'truncated' => good[0, good.size / 2], 'corrupted' => bad }.each { |what, data|
+      File.binwrite(db, data)
+      out = `../netsed -f #{db} tcp #{LPORT} #{SERVER} #{RPORT} 2>&1`
+      assert_equal(2, $?.exitstatus, out)
+      assert_match(/#{what} compiled rule file/, out)
+    }
+  ensure
+    File.delete(rules) if File.exist?(rules)
+    File.delete(db) if File.exist?(db)
+  end
+
 end
 
 # vim:sw=2:sta:et:
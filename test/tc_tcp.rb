@@ -102,6 +102,26 @@ class TC_TCPTest < Test::Unit::TestCase
     assert_equal_objects(dataexpect, datarecv)
   end
 
+  # Check the reply still arrives after the client shut down its side
+  def test_case_06_HalfClose
+    datasent = ['request andrew', 'reply andrew']
+    dataexpect = ['request mike', 'reply mike']
+    datarecv = []
+    serv = TCPServeSingleConnection.new(self.class::SERVER, RPORT) { |s|
+      # read the whole request, until the client shutdown
+      datarecv[0] = s.read
+      s.write(datasent[1])
+    }
+    streamSock = TCPSocket.new(self.class::SERVER, LPORT)
+    streamSock.write( datasent[0] )
+    streamSock.close_write
+    datarecv[1] = streamSock.read
+    streamSock.close
+    serv.join
+
+    assert_equal_objects(dataexpect, datarecv)
+  end
+
 
   # Check that netsed is still here for the test_group_all call ;)
   def test_case_zz_LastCheck
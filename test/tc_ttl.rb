@@ -70,6 +70,24 @@ class TC_TTLTest < Test::Unit::TestCase
     netsed.kill
   end
 
+  # Check infinite rules beside a rule with a TTL: the counters of a
+  # connection are its own once it used the rule.
+  def test_TTL_mixed_byConnections
+    datasent   = 'test andrew and andrew'
+    dataexpect = 'test mike AND ANDrew'
+
+    netsed = NetsedRun.new('tcp', LPORT, SERVER, RPORT, 's/te/te', 's/andrew/mike/1', 's/and/AND')
+
+    2.times { |i|
+      serv = TCPServeSingleDataSender.new(SERVER, RPORT, datasent)
+      datarecv = TCPSingleDataRecv(SERVER, LPORT, 100)
+      serv.join
+      assert_equal(dataexpect, datarecv, "At connection #{i+1}")
+    }
+  ensure
+    netsed.kill
+  end
+
 end
 
 # vim:sw=2:sta:et:
@@ -0,0 +1,75 @@
+#!/usr/bin/ruby
+# netsed Unit::Tests
+#
+# this file implements checks for unix domain socket listeners and upstreams
+# in class TC_UnixTest
+
+require 'test/unit'
+require 'test_helper'
+
+# Test Case for netsed with unix domain sockets
+class TC_UnixTest < Test::Unit::TestCase
+  LPATH='tc_unix_listen.sock'
+  RPATH='tc_unix_server.sock'
+  CPATH='tc_unix_client.sock'
+
+  def teardown
+    [LPATH, RPATH, CPATH].each { |f| File.delete(f) if File.exist?(f) }
+  end
+
+  # Check a unix stream listener forwarding to tcp.
+  def test_unix_to_tcp
+    serv = TCPServeSingleDataSender.new(SERVER, RPORT, 'test andrew')
+    netsed = NetsedRun.new('tcp', "unix:#{LPATH}", SERVER, RPORT, 's/andrew/mike')
+    sock = UNIXSocket.new(LPATH)
+    datarecv = sock.recv(100)
+    sock.close
+    serv.join
+    netsed.kill
+    assert_equal('test mike', datarecv)
+    assert(!File.exist?(LPATH), 'unix socket not removed on exit')
+  end
+
+  # Check a tcp listener forwarding to a unix stream server.
+  def test_tcp_to_unix
+    dts = UNIXServer.new(RPATH)
+    th = Thread.start {
+      s = dts.accept
+      @datarecv = s.recv(100)
+      s.write('got andrew')
+      s.close
+    }
+    netsed = NetsedRun.new('tcp', LPORT, "unix:#{RPATH}", 0, 's/andrew/mike')
+    sock = TCPSocket.new(SERVER, LPORT)
+    sock.write('andrew')
+    answer = sock.recv(100)
+    sock.close
+    th.join
+    dts.close
+    netsed.kill
+    assert_equal('mike', @datarecv)
+    assert_equal('got mike', answer)
+  end
+
+  # Check unix datagrams in both directions.
+  def test_unix_datagram
+    serv = Socket.new(:UNIX, :DGRAM)
+    serv.bind(Socket.sockaddr_un(RPATH))
+    netsed = NetsedRun.new('udp', "unix:#{LPATH}", "unix:#{RPATH}", 0, 's/andrew/mike')
+    cli = Socket.new(:UNIX, :DGRAM)
+    cli.bind(Socket.sockaddr_un(CPATH))
+    cli.connect(Socket.sockaddr_un(LPATH))
+    cli.send('andrew', 0)
+    data, from = serv.recvfrom(100)
+    serv.send("got #{data}", 0, from)
+    answer = cli.recv(100)
+    cli.close
+    serv.close
+    netsed.kill
+    assert_equal('mike', data)
+    assert_equal('got mike', answer)
+  end
+
+end
+
+# vim:sw=2:sta:et:
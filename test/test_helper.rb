@@ -18,9 +18,12 @@ SERVER=LH_IPv4
 class NetsedRun
   attr_reader :data
 
-  # Launch netsed with given parameters.
-  def initialize(proto, lport, rhost, rport, *rules)
-    @cmd="../netsed #{proto} #{lport} #{rhost} #{rport} #{rules.join(' ')}"
+  # Launch netsed with given parameters,
+  # _options_ are passed before _proto_ (e.g. '-f rules.txt'),
+  # _wrapper_ is a command running netsed (e.g. 'unshare -rm').
+  def initialize(proto, lport, rhost, rport, *rules, options: '', wrapper: '')
+    # exec: signals reach netsed even when a shell runs the command
+    @cmd="exec #{wrapper} ../netsed #{options} #{proto} #{lport} #{rhost} #{rport} #{rules.join(' ')}"
     @pipe=IO.popen(@cmd)
     @data=''
     @pipe.sync = true
@@ -31,12 +34,27 @@ class NetsedRun
     end until line =~ /^\[\+\] Listening on port/
   end
 
+  # Read netsed output until a line matches _regex_, returns that line.
+  def wait_for(regex)
+    begin
+      line = @pipe.gets
+      @data << line
+    end until line =~ regex
+    return line
+  end
+
+  # Keep reading netsed output in a thread, so that netsed never blocks
+  # on a full pipe when it prints a lot.
+  def drain
+    @drain = Thread.new { @pipe.read }
+  end
+
   # Kill (INT) and wait netsed exit
   # also returns standard output
   def kill
     Process.kill('INT', @pipe.pid)
     Process.wait(@pipe.pid)
-    @data << @pipe.read
+    @data << (@drain ? @drain.value : @pipe.read)
     @pipe.close
     return @data
   end
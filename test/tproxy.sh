@@ -0,0 +1,119 @@
+#!/bin/sh
+# netsed TPROXY test
+#
+# Builds a client, a gateway and a server network namespace linked by veth
+# pairs, runs netsed in transparent mode (-t) on the gateway and checks tcp
+# and udp, IPv4 and IPv6 connections from the client to the server address
+# are intercepted, with and without the client source address kept (-s).
+#
+# The gateway delivers the traffic to netsed with policy routing to a local
+# route, as set up with the TPROXY target; no firewall tool is needed.
+# Needs unprivileged user namespaces (or root), iproute2 and ruby.
+
+cd "$(dirname "$0")" || exit 1
+
+if [ -z "$TPROXY_NETNS" ]; then
+  TPROXY_NETNS=1 exec unshare -rnm sh ./tproxy.sh
+fi
+
+NETSED=../netsed
+PORT=7000
+FAILED=0
+
+set -e
+mkdir -p /run/netns
+mount -t tmpfs none /run/netns
+ip link set lo up
+for ns in cl sv; do
+  ip netns add $ns
+  ip -n $ns link set lo up
+done
+# client <-> gateway: v1/v0, gateway <-> server: w1/w0
+ip link add v0 type veth peer name v1 netns cl
+ip link add w0 type veth peer name w1 netns sv
+ip addr add 10.9.0.1/24 dev v0
+ip addr add fd09::1/64 dev v0 nodad
+ip addr add 10.9.1.1/24 dev w0
+ip addr add fd19::1/64 dev w0 nodad
+ip link set v0 up
+ip link set w0 up
+ip -n cl addr add 10.9.0.2/24 dev v1
+ip -n cl addr add fd09::2/64 dev v1 nodad
+ip -n cl link set v1 up
+ip -n cl route add default via 10.9.0.1
+ip -n cl -6 route add default via fd09::1
+ip -n sv addr add 10.9.1.2/24 dev w1
+ip -n sv addr add fd19::2/64 dev w1 nodad
+ip -n sv link set w1 up
+ip -n sv route add default via 10.9.1.1
+ip -n sv -6 route add default via fd19::1
+echo 1 > /proc/sys/net/ipv4/ip_forward
+echo 1 > /proc/sys/net/ipv6/conf/all/forwarding
+# traffic from the client, and back from the server for -s, is local
+ip rule add iif v0 lookup 100
+ip rule add iif w0 lookup 100
+ip route add local 0.0.0.0/0 dev lo table 100
+ip -6 rule add iif v0 lookup 100
+ip -6 rule add iif w0 lookup 100
+ip -6 route add local ::/0 dev lo table 100
+set +e
+
+ip netns exec sv ruby ./tproxy_server.rb $PORT > tproxy_server.log &
+SERVER_PID=$!
+NETSED_PID=
+
+cleanup() {
+  [ -n "$NETSED_PID" ] && kill -INT $NETSED_PID 2>/dev/null && wait $NETSED_PID 2>/dev/null
+  kill $SERVER_PID 2>/dev/null
+  rm -f tproxy_netsed.conf tproxy_rules.txt tproxy_netsed.log tproxy_server.log
+}
+trap cleanup EXIT INT TERM
+
+# client proto host: print the answer of the server through netsed
+client() {
+  ip netns exec cl ruby -rsocket -e '
+    proto, host, port = ARGV
+    if proto == "tcp"
+      s = TCPSocket.new(host, port.to_i)
+      s.write("andrew")
+    else
+      s = UDPSocket.new(host.include?(":") ? Socket::AF_INET6 : Socket::AF_INET)
+      s.connect(host, port.to_i)
+      s.send("andrew", 0)
+    end
+    # only accept the answer from the server address for udp
+    puts s.recv(100) if IO.select([s], nil, nil, 3)' "$@" $PORT
+}
+
+# check title proto host expected
+check() {
+  got=$(client $2 $3)
+  if [ "$got" = "$4" ]; then
+    echo "PASS: $1"
+  else
+    echo "FAIL: $1: expected '$4', got '$got'"
+    FAILED=1
+  fi
+}
+
+printf 'tcp %s 0 0\nudp %s 0 0\n' $PORT $PORT > tproxy_netsed.conf
+echo 's/andrew/mike' > tproxy_rules.txt
+for opt in -t "-t -s"; do
+  $NETSED $opt -c tproxy_netsed.conf -f tproxy_rules.txt > tproxy_netsed.log &
+  NETSED_PID=$!
+  i=0
+  until grep -q '^\[+\] Listening on port' tproxy_netsed.log 2>/dev/null && grep -q ready tproxy_server.log; do
+    i=$((i+1))
+    if [ $i -gt 50 ]; then echo "netsed or server did not start"; cat tproxy_netsed.log; exit 1; fi
+    sleep 0.1
+  done
+  if [ "$opt" = -t ]; then from4=10.9.1.1; from6=fd19::1; else from4=10.9.0.2; from6=fd09::2; fi
+  for proto in tcp udp; do
+    check "$opt $proto IPv4" $proto 10.9.1.2 "got mike from $from4"
+    check "$opt $proto IPv6" $proto fd19::2 "got mike from $from6"
+  done
+  kill -INT $NETSED_PID
+  wait $NETSED_PID
+  NETSED_PID=
+done
+exit $FAILED
@@ -0,0 +1,28 @@
+#!/usr/bin/ruby
+# netsed TPROXY test server
+#
+# Answers "got <data> from <client address>" on tcp and udp _port_ of all
+# addresses, so that the test can check both the forwarded data and the
+# source address seen by the server.
+
+require 'socket'
+
+port = ARGV[0].to_i
+socks = [TCPServer.new('::', port), UDPSocket.new(Socket::AF_INET6)]
+socks[1].setsockopt(Socket::IPPROTO_IPV6, Socket::IPV6_V6ONLY, 0)
+socks[1].bind('::', port)
+STDOUT.sync = true
+puts 'ready'
+loop {
+  IO.select(socks)[0].each { |s|
+    if s == socks[0]
+      c = s.accept
+      data = c.recv(100)
+      c.write("got #{data} from #{c.peeraddr[3].sub(/^::ffff:/, '')}")
+      c.close
+    else
+      data, from = s.recvfrom(100)
+      s.send("got #{data} from #{from[3].sub(/^::ffff:/, '')}", 0, from[3], from[1])
+    end
+  }
+}